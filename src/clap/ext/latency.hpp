@@ -0,0 +1,55 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#pragma once
+
+#include <concepts>
+
+#include <clap/ext/latency.h>
+
+namespace clap {
+template <typename T>
+concept Latency = requires(T &plugin) {
+  { plugin.latency_get() } -> std::same_as<uint32_t>;
+};
+
+template <Latency Plugin> struct latency {
+  static constexpr const char *id = CLAP_EXT_LATENCY;
+
+  template <typename Container> struct impl {
+    static const void *get() {
+      static clap_plugin_latency_t latency{
+          .get =
+              [](const clap_plugin_t *plugin) {
+                auto self = static_cast<Container *>(plugin->plugin_data);
+                return self->plugin_data.latency_get();
+              },
+      };
+      return &latency;
+    }
+  };
+};
+} // namespace clap
@@ -28,6 +28,7 @@
 
 #include <clap/ext/audio-ports.h>
 #include <clap/ext/gui.h>
+#include <clap/ext/latency.h>
 #include <clap/ext/log.h>
 #include <clap/ext/params.h>
 #include <clap/ext/state.h>
@@ -110,6 +111,13 @@ struct host final : clap_host_t {
     audio_ports->rescan(this, flags);
   }
 
+  inline void latency_changed() const {
+    auto latency = get_extension<clap_host_latency_t>(CLAP_EXT_LATENCY);
+    if (latency) {
+      latency->changed(this);
+    }
+  }
+
   inline void log(clap_log_severity severity, const char *msg) const {
     auto _log = get_extension<clap_host_log_t>(CLAP_EXT_LOG);
     _log->log(this, severity, msg);
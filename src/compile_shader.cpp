@@ -31,8 +31,10 @@
 #include <glslang/Public/ShaderLang.h>
 #include <glslang/SPIRV/GlslangToSpv.h>
 
+#include <algorithm>
 #include <sstream>
 #include <stdexcept>
+#include <unordered_set>
 
 #define OGLER_CONCAT_(x, y) x##y
 #define OGLER_CONCAT(x, y) OGLER_CONCAT_(x, y)
@@ -161,6 +163,8 @@ class ParamCollector : public glslang::TIntermTraverser {
   std::vector<ParameterInfo> &params;
   std::optional<int> &output_width;
   std::optional<int> &output_height;
+  std::optional<std::pair<uint32_t, uint32_t>> &gmem_range;
+  std::optional<std::pair<uint32_t, uint32_t>> &gmem_output_range;
   int params_binding;
 
   ParameterInfo *find_param(const std::string &name) {
@@ -180,7 +184,9 @@ class ParamCollector : public glslang::TIntermTraverser {
 public:
   ParamCollector(ShaderData &data, int params_binding)
       : params(data.parameters), output_width(data.output_width),
-        output_height(data.output_height), params_binding(params_binding) {}
+        output_height(data.output_height), gmem_range(data.gmem_range),
+        gmem_output_range(data.gmem_output_range),
+        params_binding(params_binding) {}
 
   void visitSymbol(glslang::TIntermSymbol *sym) final {
     auto &type = sym->getType();
@@ -253,6 +259,14 @@ public:
         output_width = c[0].getIConst();
         output_height = c[1].getIConst();
       }
+    } else if (isVector && sym->getBasicType() == glslang::EbtUint &&
+               c.size() == 2) {
+      auto &name = sym->getName();
+      if (name == "ogler_gmem_range") {
+        gmem_range = {c[0].getUConst(), c[1].getUConst()};
+      } else if (name == "ogler_gmem_output_range") {
+        gmem_output_range = {c[0].getUConst(), c[1].getUConst()};
+      }
     }
   }
 
@@ -286,6 +300,101 @@ public:
   }
 };
 
+// Unlike ParamCollector, looks at the code instead of the declarations, to
+// find out which resources are actually used
+class UsageCollector : public glslang::TIntermTraverser {
+  bool &uses_gmem;
+  bool &uses_stats;
+  std::optional<std::vector<uint32_t>> &used_channels;
+  // Channel arrays that appear as the base of a constant index
+  std::unordered_set<glslang::TIntermNode *> indexed_channels;
+
+  static bool is_gmem_accessor(const glslang::TString &name) {
+    return name.starts_with("ogler_gmem(");
+  }
+
+  static bool is_channel_array(glslang::TIntermTyped *node) {
+    if (auto sym = node->getAsSymbolNode()) {
+      return sym->getName() == "iChannel";
+    }
+    auto bin = node->getAsBinaryNode();
+    if (!bin || bin->getOp() != glslang::EOpIndexDirectStruct) {
+      return false;
+    }
+    // Members of the anonymous blocks are accessed by index
+    auto &fields = *bin->getLeft()->getType().getStruct();
+    auto index =
+        bin->getRight()->getAsConstantUnion()->getConstArray()[0].getIConst();
+    auto &name = fields[index].type->getFieldName();
+    return name == "iChannelResolution" || name == "ogler_stats";
+  }
+
+  void use_channel(uint32_t index) {
+    if (used_channels &&
+        std::find(used_channels->begin(), used_channels->end(), index) ==
+            used_channels->end()) {
+      used_channels->push_back(index);
+    }
+  }
+
+  // Any use of a channel array that is not a constant index
+  void check_channel_use(glslang::TIntermTyped *node) {
+    if (!indexed_channels.contains(node) && is_channel_array(node)) {
+      used_channels = std::nullopt;
+    }
+  }
+
+public:
+  UsageCollector(ShaderData &data)
+      : uses_gmem(data.uses_gmem),
+        uses_stats(data.uses_stats), used_channels(data.used_channels) {
+    used_channels.emplace();
+  }
+
+  void visitSymbol(glslang::TIntermSymbol *sym) final {
+    check_channel_use(sym);
+    if (sym->getBasicType() != glslang::EbtBlock) {
+      return;
+    }
+    auto &type_name = sym->getType().getTypeName();
+    if (type_name == "GmemData" || type_name == "GmemBlocks") {
+      uses_gmem = true;
+    } else if (type_name == "OglerStatsBlock") {
+      uses_stats = true;
+    }
+  }
+
+  bool visitBinary(glslang::TVisit, glslang::TIntermBinary *bin) final {
+    check_channel_use(bin);
+    auto left = bin->getLeft();
+    if (bin->getOp() == glslang::EOpIndexDirect && is_channel_array(left)) {
+      indexed_channels.insert(left);
+      use_channel(
+          bin->getRight()->getAsConstantUnion()->getConstArray()[0].getIConst());
+    }
+    return true;
+  }
+
+  bool visitAggregate(glslang::TVisit, glslang::TIntermAggregate *agg) final {
+    switch (agg->getOp()) {
+    case glslang::EOpLinkerObjects:
+      // Every global shows up in the linker objects, used or not
+      return false;
+    case glslang::EOpFunction:
+      // The accessor is always defined by the preamble, what matters is
+      // whether it is called
+      return !is_gmem_accessor(agg->getName());
+    case glslang::EOpFunctionCall:
+      if (is_gmem_accessor(agg->getName())) {
+        uses_gmem = true;
+      }
+      return true;
+    default:
+      return true;
+    }
+  }
+};
+
 std::variant<ShaderData, std::string>
 compile_shader(const std::vector<std::pair<std::string, std::string>> &source,
                int params_binding) {
@@ -324,6 +433,8 @@ compile_shader(const std::vector<std::pair<std::string, std::string>> &source,
   } catch (std::runtime_error &e) {
     return e.what();
   }
+  UsageCollector usage(data);
+  iterm->getTreeRoot()->traverse(&usage);
   glslang::GlslangToSpv(*iterm, data.spirv_code);
   return data;
 }
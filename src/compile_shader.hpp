@@ -26,6 +26,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <optional>
 #include <string>
 #include <utility>
@@ -62,6 +63,17 @@ struct ShaderData {
   std::vector<ParameterInfo> parameters;
   std::optional<int> output_width;
   std::optional<int> output_height;
+  // Whether any code reads gmem, which is always done through ogler_gmem()
+  bool uses_gmem{};
+  // Whether any code reads ogler_stats
+  bool uses_stats{};
+  // Constant indices the code uses into iChannel, iChannelResolution and
+  // ogler_stats, or std::nullopt if any of them is indexed dynamically
+  std::optional<std::vector<uint32_t>> used_channels;
+  // Part of gmem the shader declared it reads, as (first index, count)
+  std::optional<std::pair<uint32_t, uint32_t>> gmem_range;
+  // Part of gmem the shader writes back through ogler_gmem_write()
+  std::optional<std::pair<uint32_t, uint32_t>> gmem_output_range;
 };
 
 std::variant<ShaderData, std::string>
@@ -30,6 +30,7 @@
 
 #include "clap/ext/audio-ports.hpp"
 #include "clap/ext/gui.hpp"
+#include "clap/ext/latency.hpp"
 #include "clap/ext/params.hpp"
 #include "clap/ext/state.hpp"
 #include "clap/plugin.hpp"
@@ -82,8 +83,9 @@ void MessageBoxSimpl(const std::string &text, const std::string &caption,
   MessageBox(nullptr, win_text.c_str(), win_caption.c_str(), flags);
 }
 
-using ogler_plugin = clap::plugin<ogler::Ogler, clap::state, clap::gui,
-                                  clap::params, clap::audio_ports>;
+using ogler_plugin =
+    clap::plugin<ogler::Ogler, clap::state, clap::gui, clap::params,
+                 clap::audio_ports, clap::latency>;
 
 extern "C" CLAP_EXPORT const clap_plugin_entry_t clap_entry{
     .clap_version = CLAP_VERSION,
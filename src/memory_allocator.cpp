@@ -0,0 +1,349 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#include "memory_allocator.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <map>
+#include <utility>
+
+namespace ogler {
+
+struct MemoryBlock {
+  vk::raii::DeviceMemory memory;
+  uint32_t type_index;
+  vk::DeviceSize size;
+  // Holds a single resource, and is freed along with it
+  bool dedicated{};
+  void *mapped{};
+  bool coherent{};
+  // Free ranges as offset -> size, never adjacent to each other
+  std::map<vk::DeviceSize, vk::DeviceSize> free_ranges;
+  uint32_t num_allocations{};
+};
+
+static constexpr vk::DeviceSize default_block_size = 64 * 1024 * 1024;
+
+static vk::DeviceSize align_up(vk::DeviceSize value,
+                               vk::DeviceSize alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static std::optional<vk::DeviceSize> take_range(MemoryBlock &block,
+                                                vk::DeviceSize size,
+                                                vk::DeviceSize alignment) {
+  auto &ranges = block.free_ranges;
+  for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+    auto [first, length] = *it;
+    auto offset = align_up(first, alignment);
+    if (offset + size > first + length) {
+      continue;
+    }
+
+    ranges.erase(it);
+    if (offset > first) {
+      ranges.emplace(first, offset - first);
+    }
+    if (offset + size < first + length) {
+      ranges.emplace(offset + size, first + length - (offset + size));
+    }
+    ++block.num_allocations;
+    return offset;
+  }
+  return std::nullopt;
+}
+
+Allocation::Allocation(Allocation &&other) noexcept
+    : allocator(std::exchange(other.allocator, nullptr)),
+      block(std::exchange(other.block, nullptr)), offset_(other.offset_),
+      size_(other.size_) {}
+
+Allocation &Allocation::operator=(Allocation &&other) noexcept {
+  if (this != &other) {
+    if (allocator) {
+      allocator->free(block, offset_, size_);
+    }
+    allocator = std::exchange(other.allocator, nullptr);
+    block = std::exchange(other.block, nullptr);
+    offset_ = other.offset_;
+    size_ = other.size_;
+  }
+  return *this;
+}
+
+Allocation::~Allocation() {
+  if (allocator) {
+    allocator->free(block, offset_, size_);
+  }
+}
+
+vk::DeviceMemory Allocation::memory() const { return *block->memory; }
+
+void Allocation::invalidate() const {
+  if (!block->mapped || block->coherent) {
+    return;
+  }
+  allocator->device.invalidateMappedMemoryRanges({{
+      .memory = *block->memory,
+      .offset = offset_,
+      .size = size_,
+  }});
+}
+
+void *Allocation::mapped() const {
+  if (!block->mapped) {
+    return nullptr;
+  }
+  return static_cast<char *>(block->mapped) + offset_;
+}
+
+MemoryAllocator::MemoryAllocator(vk::raii::PhysicalDevice &phys_device,
+                                 vk::raii::Device &device)
+    : device(device), props(phys_device.getMemoryProperties()),
+      buffer_image_granularity(
+          phys_device.getProperties().limits.bufferImageGranularity),
+      non_coherent_atom_size(
+          phys_device.getProperties().limits.nonCoherentAtomSize),
+      blocks(props.memoryTypeCount), stats(props.memoryHeapCount) {}
+
+MemoryAllocator::~MemoryAllocator() = default;
+
+std::optional<uint32_t>
+MemoryAllocator::find_memory_type(uint32_t type_bits,
+                                  vk::MemoryPropertyFlags required,
+                                  vk::MemoryPropertyFlags preferred) {
+  std::optional<uint32_t> best;
+  int best_score = 0;
+  for (uint32_t i = 0; i < props.memoryTypeCount; ++i) {
+    auto flags = props.memoryTypes[i].propertyFlags;
+    if (!(type_bits & (1u << i)) || (flags & required) != required) {
+      continue;
+    }
+    // Properties nobody asked for usually come at a cost, e.g. host visible
+    // device memory is scarce and uncached host memory is slow to read
+    auto wanted = static_cast<uint32_t>(flags & preferred);
+    auto unwanted = static_cast<uint32_t>(flags & ~(required | preferred));
+    int score = 2 * std::popcount(wanted) - std::popcount(unwanted);
+    if (!best || score > best_score) {
+      best = i;
+      best_score = score;
+    }
+  }
+  return best;
+}
+
+vk::DeviceSize MemoryAllocator::block_size(uint32_t type_index) const {
+  auto heap_size =
+      props.memoryHeaps[props.memoryTypes[type_index].heapIndex].size;
+  return std::min(default_block_size, heap_size / 8);
+}
+
+MemoryBlock &MemoryAllocator::create_block(uint32_t type_index,
+                                           vk::DeviceSize size,
+                                           const void *dedicated_info) {
+  vk::MemoryAllocateInfo alloc_info{
+      .pNext = dedicated_info,
+      .allocationSize = size,
+      .memoryTypeIndex = type_index,
+  };
+  auto block = std::make_unique<MemoryBlock>(MemoryBlock{
+      .memory = device.allocateMemory(alloc_info),
+      .type_index = type_index,
+      .size = size,
+      .dedicated = dedicated_info != nullptr,
+  });
+  auto flags = props.memoryTypes[type_index].propertyFlags;
+  if (flags & vk::MemoryPropertyFlagBits::eHostVisible) {
+    block->mapped = block->memory.mapMemory(0, VK_WHOLE_SIZE);
+  }
+  block->coherent = bool(flags & vk::MemoryPropertyFlagBits::eHostCoherent);
+  if (!block->dedicated) {
+    block->free_ranges.emplace(0, size);
+  }
+
+  auto &stat = stats[props.memoryTypes[type_index].heapIndex];
+  ++stat.block_count;
+  stat.block_bytes += size;
+
+  auto &type_blocks = blocks[type_index];
+  type_blocks.push_back(std::move(block));
+  return *type_blocks.back();
+}
+
+Allocation
+MemoryAllocator::allocate(const vk::MemoryRequirements &reqs,
+                          vk::MemoryPropertyFlags required,
+                          vk::MemoryPropertyFlags preferred,
+                          bool optimal_tiling, bool prefers_dedicated,
+                          const vk::MemoryDedicatedAllocateInfo &dedicated_info) {
+  auto type_index = find_memory_type(reqs.memoryTypeBits, required, preferred);
+  if (!type_index) {
+    throw vk::OutOfDeviceMemoryError("No suitable memory type");
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  auto &stat = stats[props.memoryTypes[*type_index].heapIndex];
+
+  // Large resources would waste most of a block, or not fit at all
+  if (prefers_dedicated || reqs.size >= block_size(*type_index) / 2) {
+    auto &block = create_block(*type_index, reqs.size, &dedicated_info);
+    block.num_allocations = 1;
+    ++stat.allocation_count;
+    stat.allocated_bytes += reqs.size;
+    return Allocation(this, &block, 0, reqs.size);
+  }
+
+  // Linear and optimal resources must not share a page of this size, which is
+  // guaranteed if images are given whole pages
+  auto alignment = reqs.alignment;
+  auto size = reqs.size;
+  if (optimal_tiling) {
+    alignment = std::max(alignment, buffer_image_granularity);
+    size = align_up(size, buffer_image_granularity);
+  }
+  // Ranges to invalidate are expressed in atoms, which must not be shared
+  // with other allocations
+  auto flags = props.memoryTypes[*type_index].propertyFlags;
+  if ((flags & vk::MemoryPropertyFlagBits::eHostVisible) &&
+      !(flags & vk::MemoryPropertyFlagBits::eHostCoherent)) {
+    alignment = std::max(alignment, non_coherent_atom_size);
+    size = align_up(size, non_coherent_atom_size);
+  }
+
+  std::optional<vk::DeviceSize> offset;
+  MemoryBlock *block = nullptr;
+  for (auto &candidate : blocks[*type_index]) {
+    if (candidate->dedicated) {
+      continue;
+    }
+    if ((offset = take_range(*candidate, size, alignment))) {
+      block = candidate.get();
+      break;
+    }
+  }
+  if (!block) {
+    try {
+      block = &create_block(*type_index, block_size(*type_index), nullptr);
+    } catch (vk::OutOfDeviceMemoryError &) {
+      // The heap might still have room for this resource alone
+      block = &create_block(*type_index, size, nullptr);
+    }
+    offset = take_range(*block, size, alignment);
+  }
+
+  ++stat.allocation_count;
+  stat.allocated_bytes += size;
+  return Allocation(this, block, *offset, size);
+}
+
+Allocation MemoryAllocator::allocate(vk::raii::Buffer &buffer,
+                                     vk::MemoryPropertyFlags required,
+                                     vk::MemoryPropertyFlags preferred) {
+  auto reqs = device.getBufferMemoryRequirements2<
+      vk::MemoryRequirements2, vk::MemoryDedicatedRequirements>({
+      .buffer = *buffer,
+  });
+  auto &dedicated = reqs.get<vk::MemoryDedicatedRequirements>();
+  auto allocation =
+      allocate(reqs.get<vk::MemoryRequirements2>().memoryRequirements,
+               required, preferred, false,
+               dedicated.prefersDedicatedAllocation ||
+                   dedicated.requiresDedicatedAllocation,
+               {.buffer = *buffer});
+  buffer.bindMemory(allocation.memory(), allocation.offset());
+  return allocation;
+}
+
+Allocation MemoryAllocator::allocate(vk::raii::Image &image,
+                                     vk::MemoryPropertyFlags required,
+                                     vk::MemoryPropertyFlags preferred) {
+  auto reqs = device.getImageMemoryRequirements2<
+      vk::MemoryRequirements2, vk::MemoryDedicatedRequirements>({
+      .image = *image,
+  });
+  auto &dedicated = reqs.get<vk::MemoryDedicatedRequirements>();
+  auto allocation =
+      allocate(reqs.get<vk::MemoryRequirements2>().memoryRequirements,
+               required, preferred, true,
+               dedicated.prefersDedicatedAllocation ||
+                   dedicated.requiresDedicatedAllocation,
+               {.image = *image});
+  image.bindMemory(allocation.memory(), allocation.offset());
+  return allocation;
+}
+
+void MemoryAllocator::free(MemoryBlock *block, vk::DeviceSize offset,
+                           vk::DeviceSize size) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto type_index = block->type_index;
+  auto &stat = stats[props.memoryTypes[type_index].heapIndex];
+  --stat.allocation_count;
+  stat.allocated_bytes -= size;
+
+  auto &ranges = block->free_ranges;
+  if (!block->dedicated) {
+    auto it = ranges.emplace(offset, size).first;
+    if (auto next = std::next(it);
+        next != ranges.end() && it->first + it->second == next->first) {
+      it->second += next->second;
+      ranges.erase(next);
+    }
+    if (it != ranges.begin()) {
+      if (auto prev = std::prev(it); prev->first + prev->second == it->first) {
+        prev->second += it->second;
+        ranges.erase(it);
+      }
+    }
+  }
+
+  if (--block->num_allocations > 0) {
+    return;
+  }
+
+  // Keep one empty block around, so that a resource being recreated doesn't
+  // free and allocate a whole block
+  auto &type_blocks = blocks[type_index];
+  if (!block->dedicated &&
+      std::count_if(type_blocks.begin(), type_blocks.end(),
+                    [](const std::unique_ptr<MemoryBlock> &b) {
+                      return !b->dedicated && b->num_allocations == 0;
+                    }) <= 1) {
+    return;
+  }
+
+  --stat.block_count;
+  stat.block_bytes -= block->size;
+  std::erase_if(type_blocks, [block](const std::unique_ptr<MemoryBlock> &b) {
+    return b.get() == block;
+  });
+}
+
+std::vector<MemoryAllocator::HeapStats> MemoryAllocator::heap_stats() {
+  std::unique_lock<std::mutex> lock(mutex);
+  return stats;
+}
+} // namespace ogler
@@ -0,0 +1,131 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#pragma once
+
+#define VULKAN_HPP_NO_STRUCT_CONSTRUCTORS
+#include <vulkan/vulkan_raii.hpp>
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace ogler {
+
+class MemoryAllocator;
+struct MemoryBlock;
+
+// A range of device memory handed out by MemoryAllocator, returned to it when
+// destroyed
+class Allocation {
+  friend class MemoryAllocator;
+
+  MemoryAllocator *allocator{};
+  MemoryBlock *block{};
+  vk::DeviceSize offset_{};
+  vk::DeviceSize size_{};
+
+  Allocation(MemoryAllocator *allocator, MemoryBlock *block,
+             vk::DeviceSize offset, vk::DeviceSize size)
+      : allocator(allocator), block(block), offset_(offset), size_(size) {}
+
+public:
+  Allocation() = default;
+  Allocation(Allocation &&other) noexcept;
+  Allocation &operator=(Allocation &&other) noexcept;
+  ~Allocation();
+
+  vk::DeviceMemory memory() const;
+  vk::DeviceSize offset() const { return offset_; }
+  vk::DeviceSize size() const { return size_; }
+  // Start of the allocation in host memory, or nullptr if the memory type is
+  // not host visible
+  void *mapped() const;
+  // Makes device writes visible to the host, if the memory is not coherent
+  void invalidate() const;
+};
+
+// Sub-allocates resources from large blocks of device memory, since the number
+// of allocations a device supports can be as low as 4096 and every instance
+// needs dozens of buffers and images
+class MemoryAllocator {
+public:
+  struct HeapStats {
+    uint32_t block_count;
+    uint32_t allocation_count;
+    vk::DeviceSize block_bytes;
+    vk::DeviceSize allocated_bytes;
+  };
+
+  MemoryAllocator(vk::raii::PhysicalDevice &phys_device,
+                  vk::raii::Device &device);
+  ~MemoryAllocator();
+
+  MemoryAllocator(const MemoryAllocator &) = delete;
+  MemoryAllocator &operator=(const MemoryAllocator &) = delete;
+
+  // Allocate and bind memory with at least the required properties, favoring
+  // types that also have the preferred ones
+  Allocation allocate(vk::raii::Buffer &buffer,
+                      vk::MemoryPropertyFlags required,
+                      vk::MemoryPropertyFlags preferred = {});
+  Allocation allocate(vk::raii::Image &image, vk::MemoryPropertyFlags required,
+                      vk::MemoryPropertyFlags preferred = {});
+
+  std::optional<uint32_t> find_memory_type(uint32_t type_bits,
+                                           vk::MemoryPropertyFlags required,
+                                           vk::MemoryPropertyFlags preferred);
+  vk::MemoryPropertyFlags memory_type_flags(uint32_t type_index) const {
+    return props.memoryTypes[type_index].propertyFlags;
+  }
+
+  std::vector<HeapStats> heap_stats();
+
+private:
+  friend class Allocation;
+
+  vk::raii::Device &device;
+  vk::PhysicalDeviceMemoryProperties props;
+  vk::DeviceSize buffer_image_granularity;
+  vk::DeviceSize non_coherent_atom_size;
+
+  std::mutex mutex;
+  // Blocks sub-allocations are taken from, by memory type
+  std::vector<std::vector<std::unique_ptr<MemoryBlock>>> blocks;
+  std::vector<HeapStats> stats;
+
+  vk::DeviceSize block_size(uint32_t type_index) const;
+  MemoryBlock &create_block(uint32_t type_index, vk::DeviceSize size,
+                            const void *dedicated_info);
+  Allocation allocate(const vk::MemoryRequirements &reqs,
+                      vk::MemoryPropertyFlags required,
+                      vk::MemoryPropertyFlags preferred, bool optimal_tiling,
+                      bool prefers_dedicated,
+                      const vk::MemoryDedicatedAllocateInfo &dedicated_info);
+  void free(MemoryBlock *block, vk::DeviceSize offset, vk::DeviceSize size);
+};
+} // namespace ogler
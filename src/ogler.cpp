@@ -27,9 +27,11 @@
 #include "ogler.hpp"
 #include "compile_shader.hpp"
 #include "ogler_compute.hpp"
+#include "ogler_debug.hpp"
 #include "ogler_editor.hpp"
 #include "ogler_preferences.hpp"
 #include "ogler_uniforms.hpp"
+#include "shader_cache.hpp"
 #include "string_utils.hpp"
 
 #include <clap/events.h>
@@ -42,26 +44,553 @@
 #include <reaper_plugin_functions.h>
 
 #include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
 #include <mutex>
 #include <optional>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <utility>
 #include <variant>
 
 namespace ogler {
 
+static vk::Extent2D choose_tile_size(VulkanContext &vulkan) {
+  auto props = vulkan.phys_device.getProperties();
+  auto &limits = props.limits;
+
+  // Discrete GPUs have wide enough compute units to keep 16x16 tiles busy,
+  // integrated ones tend to do better with smaller workgroups
+  uint32_t side =
+      props.deviceType == vk::PhysicalDeviceType::eDiscreteGpu ? 16 : 8;
+  while (side > 1 && (side * side > limits.maxComputeWorkGroupInvocations ||
+                      side > limits.maxComputeWorkGroupSize[0] ||
+                      side > limits.maxComputeWorkGroupSize[1])) {
+    side /= 2;
+  }
+
+  return {
+      .width = side,
+      .height = side,
+  };
+}
+
+static Buffer<float> create_gmem_transfer_buffer(VulkanContext &vulkan,
+                                                uint32_t num_blocks) {
+  return vulkan.create_buffer<float>(
+      {}, num_blocks * NSEEL_RAM_ITEMSPERBLOCK,
+      vk::BufferUsageFlagBits::eTransferSrc, vk::SharingMode::eExclusive,
+      vk::MemoryPropertyFlagBits::eHostVisible |
+          vk::MemoryPropertyFlagBits::eHostCoherent);
+}
+
+static Buffer<float> create_gmem_buffer(VulkanContext &vulkan,
+                                        uint32_t num_blocks) {
+  return vulkan.create_buffer<float>(
+      {}, num_blocks * NSEEL_RAM_ITEMSPERBLOCK,
+      vk::BufferUsageFlagBits::eTransferSrc |
+          vk::BufferUsageFlagBits::eTransferDst |
+          vk::BufferUsageFlagBits::eStorageBuffer,
+      vk::SharingMode::eExclusive, vk::MemoryPropertyFlagBits::eDeviceLocal,
+      false);
+}
+
 SharedVulkan::SharedVulkan()
-    : gmem_transfer_buffer(vulkan.create_buffer<float>(
-          {}, gmem_size, vk::BufferUsageFlagBits::eTransferSrc,
-          vk::SharingMode::eExclusive,
-          vk::MemoryPropertyFlagBits::eHostVisible |
-              vk::MemoryPropertyFlagBits::eHostCoherent)),
-      gmem_buffer(vulkan.create_buffer<float>(
-          {}, gmem_size,
+    : tile_size(choose_tile_size(vulkan)),
+      workers(std::max(std::thread::hardware_concurrency(), 1u) - 1),
+      compile_workers(std::max(std::thread::hardware_concurrency() / 2, 1u)),
+      pipeline_cache(vulkan.create_pipeline_cache()),
+      queue(vulkan.get_queue(0)),
+      gmem_command_buffer(vulkan.create_command_buffer()),
+      gmem_fence(vulkan.create_fence()),
+      gmem_slots(NSEEL_RAM_BLOCKS, -1), gmem_capacity(1),
+      gmem_transfer_buffer(create_gmem_transfer_buffer(vulkan, gmem_capacity)),
+      gmem_buffer(std::make_shared<Buffer<float>>(
+          create_gmem_buffer(vulkan, gmem_capacity))),
+      gmem_block_table(vulkan.create_buffer<int32_t>(
+          {}, NSEEL_RAM_BLOCKS,
           vk::BufferUsageFlagBits::eTransferDst |
               vk::BufferUsageFlagBits::eStorageBuffer,
           vk::SharingMode::eExclusive, vk::MemoryPropertyFlagBits::eDeviceLocal,
-          false)) {}
+          false)),
+      gmem_shadow(NSEEL_RAM_BLOCKS) {}
+
+SharedVulkan::~SharedVulkan() {
+  vulkan.device.waitIdle();
+  save_pipeline_cache(true);
+}
+
+void SharedVulkan::load_pipeline_cache(const std::filesystem::path &path) {
+  std::unique_lock<std::mutex> lock(pipeline_cache_mutex);
+  pipeline_cache_path = path;
+  pipeline_cache_saved_at = std::chrono::steady_clock::now();
+
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return;
+  }
+  std::vector<char> data{std::istreambuf_iterator<char>(file),
+                         std::istreambuf_iterator<char>()};
+  // Instances hold on to the shared cache, so it can only be added to
+  auto loaded = vulkan.create_pipeline_cache(data);
+  pipeline_cache.merge({*loaded});
+  pipeline_cache_saved_size =
+      vulkan.get_pipeline_cache_data(pipeline_cache).size();
+}
+
+void SharedVulkan::save_pipeline_cache(bool force) {
+  std::unique_lock<std::mutex> lock(pipeline_cache_mutex);
+  if (pipeline_cache_path.empty()) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (!force && now - pipeline_cache_saved_at < std::chrono::minutes(1)) {
+    return;
+  }
+  pipeline_cache_saved_at = now;
+
+  // The cache only ever grows, so an unchanged size means unchanged contents
+  auto data = vulkan.get_pipeline_cache_data(pipeline_cache);
+  if (data.size() == pipeline_cache_saved_size) {
+    return;
+  }
+
+  // Written aside and moved in place, so that other REAPER processes, or a
+  // crash halfway through, never see a partial file
+  auto tmp_path = pipeline_cache_path;
+  tmp_path += ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    file.write(data.data(), data.size());
+    if (!file) {
+      DBG << "ogler: could not write the pipeline cache\n";
+      return;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, pipeline_cache_path, ec);
+  if (ec) {
+    DBG << "ogler: could not write the pipeline cache: " << ec.message()
+        << "\n";
+    return;
+  }
+  pipeline_cache_saved_size = data.size();
+}
+
+std::shared_ptr<SharedShader>
+SharedVulkan::find_shader(const std::string &source) {
+  std::unique_lock<std::mutex> lock(shaders_mutex);
+  std::erase_if(shaders, [](auto &entry) { return entry.second.expired(); });
+  auto &entry = shaders[source];
+  auto shader = entry.lock();
+  if (!shader) {
+    shader = std::make_shared<SharedShader>();
+    entry = shader;
+  }
+  return shader;
+}
+
+std::shared_ptr<StatsProgram> SharedVulkan::get_stats_program() {
+  std::unique_lock<std::mutex> lock(stats_program_mutex);
+  auto program = stats_program.lock();
+  if (!program) {
+    program = std::make_shared<StatsProgram>(vulkan, pipeline_cache);
+    stats_program = program;
+  }
+  return program;
+}
+
+InputImage SharedVulkan::create_input_image(int w, int h,
+                                            int transfer_size) {
+  auto img = vulkan.create_image(
+      w, h, RGBAFormat, vk::ImageTiling::eOptimal,
+      vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled);
+  auto buf = vulkan.create_buffer<char>(
+      {}, transfer_size, vk::BufferUsageFlagBits::eTransferSrc,
+      vk::SharingMode::eExclusive,
+      vk::MemoryPropertyFlagBits::eHostVisible |
+          vk::MemoryPropertyFlagBits::eHostCoherent);
+  auto view = vulkan.create_image_view(img, RGBAFormat);
+
+  return {
+      .image = std::move(img),
+      .transfer_buffer = std::move(buf),
+      .view = std::move(view),
+  };
+}
+
+InputImage SharedVulkan::acquire_input_image(int w, int h,
+                                             int transfer_size) {
+  {
+    std::unique_lock<std::mutex> lock(input_pool_mutex);
+    // Most recently released first, it is the most likely to be warm
+    auto it = std::find_if(input_pool.rbegin(), input_pool.rend(),
+                           [&](const InputImage &input) {
+                             return input.image.width == w &&
+                                    input.image.height == h &&
+                                    input.transfer_buffer.size >= transfer_size;
+                           });
+    if (it != input_pool.rend()) {
+      auto input = std::move(*it);
+      input_pool.erase(std::next(it).base());
+      return input;
+    }
+  }
+  return create_input_image(w, h, transfer_size);
+}
+
+OutputImage SharedVulkan::acquire_output_image(int w, int h) {
+  {
+    std::unique_lock<std::mutex> lock(output_pool_mutex);
+    auto it = std::find_if(output_pool.rbegin(), output_pool.rend(),
+                           [&](const OutputImage &output) {
+                             return output.width == w && output.height == h;
+                           });
+    if (it != output_pool.rend()) {
+      auto output = std::move(*it);
+      output_pool.erase(std::next(it).base());
+      return output;
+    }
+  }
+  auto img = vulkan.create_image(w, h, RGBAFormat, vk::ImageTiling::eOptimal,
+                                 vk::ImageUsageFlagBits::eStorage |
+                                     vk::ImageUsageFlagBits::eTransferSrc |
+                                     vk::ImageUsageFlagBits::eSampled);
+  auto view = vulkan.create_image_view(img, RGBAFormat);
+  return OutputImage(std::move(img), std::move(view));
+}
+
+void SharedVulkan::release_output_image(OutputImage image) {
+  std::unique_lock<std::mutex> lock(output_pool_mutex);
+  if (output_pool.size() >= max_pooled_outputs) {
+    output_pool.erase(output_pool.begin());
+  }
+  output_pool.push_back(std::move(image));
+}
+
+void SharedVulkan::release_input_image(InputImage image) {
+  std::unique_lock<std::mutex> lock(input_pool_mutex);
+  if (input_pool.size() >= max_pooled_inputs) {
+    input_pool.erase(input_pool.begin());
+  }
+  input_pool.push_back(std::move(image));
+}
+
+void SharedVulkan::submit(vk::raii::CommandBuffer &command_buffer,
+                          vk::Fence fence) {
+  vk::CommandBuffer buffers[] = {*command_buffer};
+  submit(buffers, fence);
+}
+
+void SharedVulkan::submit(std::span<const vk::CommandBuffer> command_buffers,
+                          vk::Fence fence) {
+  vk::SubmitInfo submit_info{
+      .commandBufferCount = static_cast<uint32_t>(command_buffers.size()),
+      .pCommandBuffers = command_buffers.data(),
+  };
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  queue.submit({submit_info}, fence);
+}
+
+void SharedVulkan::LockStats::record(std::chrono::nanoseconds duration) {
+  auto ns = duration.count();
+  last_ns = ns;
+  total_ns += ns;
+  ++count;
+
+  auto prev_max = max_ns.load();
+  while (ns > prev_max && !max_ns.compare_exchange_weak(prev_max, ns)) {
+  }
+}
+
+std::string SharedVulkan::statistics() {
+  std::ostringstream res;
+  auto count = gmem_lock_stats.count.load();
+  res << "gmem snapshots taken: " << count << "\n";
+  if (count > 0) {
+    res << "EEL mutex held for: " << gmem_lock_stats.last_ns / 1000
+        << "us last, " << gmem_lock_stats.total_ns / count / 1000
+        << "us average, " << gmem_lock_stats.max_ns / 1000 << "us max\n";
+  }
+
+  auto heaps = vulkan.allocator.heap_stats();
+  for (size_t i = 0; i < heaps.size(); ++i) {
+    auto &heap = heaps[i];
+    if (heap.block_count == 0) {
+      continue;
+    }
+    res << "Memory heap " << i << ": " << heap.allocation_count
+        << " allocations using " << (heap.allocated_bytes >> 20) << " MiB of "
+        << heap.block_count << " blocks totaling "
+        << (heap.block_bytes >> 20) << " MiB\n";
+  }
+  return res.str();
+}
+
+std::string Ogler::statistics() { return get_shared_vulkan().statistics(); }
+
+static std::chrono::steady_clock::duration frame_duration(double framerate) {
+  return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(framerate > 0 ? 1.0 / framerate : 0.0));
+}
+
+bool SharedVulkan::is_gmem_current(double project_time, double framerate,
+                                   uint32_t begin, uint32_t count) {
+  std::unique_lock<std::mutex> lock(gmem_mutex);
+  // Another instance might have taken the snapshot but not submitted the
+  // upload yet, and our frame must not be submitted before it
+  if (!gmem_dirty_chunks.empty() || gmem_block_table_dirty) {
+    return false;
+  }
+  if (!gmem_tick || gmem_tick->project_time != project_time) {
+    return false;
+  }
+
+  // When playback is stopped the same time is rendered over and over, while
+  // JSFX might still be changing gmem. Only share snapshots within a frame.
+  auto now = std::chrono::steady_clock::now();
+  if (now - gmem_tick->taken_at > gmem_tick->frame_duration) {
+    return false;
+  }
+
+  auto end = uint64_t(begin) + count;
+  return std::any_of(gmem_tick->ranges.begin(), gmem_tick->ranges.end(),
+                     [&](const std::pair<uint32_t, uint32_t> &range) {
+                       return range.first <= begin &&
+                              uint64_t(range.first) + range.second >= end;
+                     });
+}
+
+void SharedVulkan::snapshot_gmem(double **blocks, uint32_t begin,
+                                 uint32_t count, double project_time,
+                                 double framerate) {
+  begin = std::min(begin, gmem_size);
+  auto end = begin + std::min(count, gmem_size - begin);
+  if (begin == end) {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(gmem_mutex);
+
+  auto now = std::chrono::steady_clock::now();
+  if (!gmem_tick || gmem_tick->project_time != project_time ||
+      now - gmem_tick->taken_at > gmem_tick->frame_duration) {
+    gmem_tick = GmemTick{
+        .project_time = project_time,
+        .taken_at = now,
+        .frame_duration = frame_duration(framerate),
+    };
+  }
+  gmem_tick->ranges.emplace_back(begin, end - begin);
+
+  // Chunks of the allocated blocks that fall inside the range
+  struct Chunk {
+    size_t first;
+    size_t last;
+    bool dirty;
+  };
+  std::vector<Chunk> chunks;
+  for (size_t i = begin / NSEEL_RAM_ITEMSPERBLOCK;
+       i * NSEEL_RAM_ITEMSPERBLOCK < end; ++i) {
+    if (!blocks[i]) {
+      continue;
+    }
+
+    bool new_block = !gmem_shadow[i];
+    if (new_block) {
+      gmem_shadow[i] =
+          std::make_unique_for_overwrite<double[]>(NSEEL_RAM_ITEMSPERBLOCK);
+      gmem_slots[i] = gmem_num_slots++;
+      gmem_block_table_dirty = true;
+    }
+
+    auto block_end = std::min<size_t>((i + 1) * NSEEL_RAM_ITEMSPERBLOCK, end);
+    for (auto first = std::max<size_t>(i * NSEEL_RAM_ITEMSPERBLOCK, begin);
+         first < block_end;) {
+      auto last = std::min(first - first % gmem_chunk_size + gmem_chunk_size,
+                           block_end);
+      chunks.push_back({first, last, new_block});
+      first = last;
+    }
+  }
+
+  workers.parallel_for(
+      chunks.size(), 16, [&](size_t first_chunk, size_t last_chunk) {
+        for (auto i = first_chunk; i < last_chunk; ++i) {
+          auto &chunk = chunks[i];
+          auto block = chunk.first / NSEEL_RAM_ITEMSPERBLOCK;
+          auto offset = chunk.first % NSEEL_RAM_ITEMSPERBLOCK;
+          auto size = (chunk.last - chunk.first) * sizeof(double);
+          auto src = blocks[block] + offset;
+          auto shadow = gmem_shadow[block].get() + offset;
+
+          if (chunk.dirty || std::memcmp(src, shadow, size) != 0) {
+            chunk.dirty = true;
+            std::memcpy(shadow, src, size);
+          }
+        }
+      });
+
+  for (auto &chunk : chunks) {
+    if (chunk.dirty) {
+      gmem_dirty_chunks.emplace_back(chunk.first, chunk.last);
+    }
+  }
+}
+
+SharedVulkan::GmemBindings SharedVulkan::gmem_bindings() {
+  std::unique_lock<std::mutex> lock(gmem_mutex);
+  if (gmem_pending && !gmem_retired_buffers.empty() &&
+      gmem_fence.getStatus() == vk::Result::eSuccess) {
+    gmem_retired_buffers.clear();
+  }
+  return {
+      .buffer = gmem_buffer,
+      .block_table = *gmem_block_table.buffer,
+      .generation = gmem_generation,
+  };
+}
+
+void SharedVulkan::flush_gmem() {
+  std::unique_lock<std::mutex> lock(gmem_mutex);
+  bool grow = gmem_num_slots > gmem_capacity;
+  if (gmem_dirty_chunks.empty() && !grow && !gmem_block_table_dirty) {
+    return;
+  }
+
+  if (gmem_pending) {
+    auto res = vulkan.device.waitForFences({*gmem_fence}, // List of fences
+                                           true,          // Wait All
+                                           uint64_t(-1)); // Timeout
+    assert(res == vk::Result::eSuccess);
+    vulkan.device.resetFences({*gmem_fence});
+    gmem_command_buffer.reset();
+    gmem_retired_buffers.clear();
+    gmem_pending = false;
+  }
+
+  {
+    vk::CommandBufferBeginInfo begin_info{
+        .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit,
+    };
+    gmem_command_buffer.begin(begin_info);
+  }
+  // Frames submitted earlier might still be reading the gmem buffers
+  gmem_command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                                      vk::PipelineStageFlagBits::eTransfer, {},
+                                      {}, {}, {});
+
+  constexpr auto block_bytes = NSEEL_RAM_ITEMSPERBLOCK * sizeof(float);
+
+  if (grow) {
+    auto new_capacity = std::max(gmem_num_slots, gmem_capacity * 2);
+    auto new_buffer = std::make_shared<Buffer<float>>(
+        create_gmem_buffer(vulkan, new_capacity));
+    gmem_command_buffer.copyBuffer(*gmem_buffer->buffer, *new_buffer->buffer,
+                                   {vk::BufferCopy{
+                                       .size = gmem_capacity * block_bytes,
+                                   }});
+    gmem_retired_buffers.push_back(std::move(gmem_buffer));
+    gmem_buffer = std::move(new_buffer);
+    // The previous upload has completed, nothing uses the staging contents
+    gmem_transfer_buffer = create_gmem_transfer_buffer(vulkan, new_capacity);
+    gmem_capacity = new_capacity;
+    ++gmem_generation;
+
+    // The uploads below overwrite parts of the copy
+    vk::MemoryBarrier mem_barrier{
+        .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+        .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+    };
+    gmem_command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                        vk::PipelineStageFlagBits::eTransfer,
+                                        {}, {mem_barrier}, {}, {});
+  }
+
+  if (gmem_block_table_dirty) {
+    gmem_command_buffer.updateBuffer<int32_t>(*gmem_block_table.buffer, 0,
+                                              gmem_slots);
+    gmem_block_table_dirty = false;
+  }
+
+  // Several snapshots, possibly of different ranges, may have been taken
+  // since the last flush. Copy regions must not overlap, so merge them.
+  std::sort(gmem_dirty_chunks.begin(), gmem_dirty_chunks.end());
+  std::vector<std::pair<size_t, size_t>> ranges;
+  for (auto [first, last] : gmem_dirty_chunks) {
+    if (!ranges.empty() && first <= ranges.back().second) {
+      ranges.back().second = std::max(ranges.back().second, last);
+    } else {
+      ranges.emplace_back(first, last);
+    }
+  }
+  gmem_dirty_chunks.clear();
+
+  // Position of a gmem item in the compact buffer
+  auto compact_index = [this](size_t index) {
+    return gmem_slots[index / NSEEL_RAM_ITEMSPERBLOCK] *
+               NSEEL_RAM_ITEMSPERBLOCK +
+           index % NSEEL_RAM_ITEMSPERBLOCK;
+  };
+
+  // Ranges can span several blocks, which are not contiguous in the compact
+  // buffer, so split them by chunk
+  std::vector<std::pair<size_t, size_t>> chunks;
+  for (auto [first, last] : ranges) {
+    while (first < last) {
+      auto chunk_last = std::min(
+          first - first % gmem_chunk_size + gmem_chunk_size, last);
+      chunks.emplace_back(first, chunk_last);
+      first = chunk_last;
+    }
+  }
+
+  auto dst = gmem_transfer_buffer.map.data();
+  workers.parallel_for(
+      chunks.size(), 16, [&](size_t first_chunk, size_t last_chunk) {
+        for (auto i = first_chunk; i < last_chunk; ++i) {
+          auto [first, last] = chunks[i];
+          auto src = gmem_shadow[first / NSEEL_RAM_ITEMSPERBLOCK].get() +
+                     first % NSEEL_RAM_ITEMSPERBLOCK;
+          auto chunk_dst = dst + compact_index(first);
+          for (size_t j = 0; j < last - first; ++j) {
+            chunk_dst[j] = src[j];
+          }
+        }
+      });
+
+  // Chunks that are adjacent in the compact buffer are merged into one region
+  std::vector<vk::BufferCopy> regions;
+  for (auto [first, last] : chunks) {
+    auto offset = compact_index(first) * sizeof(float);
+    auto size = (last - first) * sizeof(float);
+    if (!regions.empty() &&
+        regions.back().srcOffset + regions.back().size == offset) {
+      regions.back().size += size;
+    } else {
+      regions.push_back({
+          .srcOffset = offset,
+          .dstOffset = offset,
+          .size = size,
+      });
+    }
+  }
+
+  if (!regions.empty()) {
+    gmem_command_buffer.copyBuffer(*gmem_transfer_buffer.buffer,
+                                   *gmem_buffer->buffer, regions);
+  }
+  gmem_command_buffer.end();
+
+  submit(gmem_command_buffer, *gmem_fence);
+  gmem_pending = true;
+}
 
 int Ogler::get_output_width() {
   if (shader_output_width.has_value()) {
@@ -87,36 +616,13 @@ Ogler::Ogler(const clap::host &host)
     : host(host), reaper(IReaper::get_reaper(host)),
       shared(get_shared_vulkan()),
       command_buffer(shared.vulkan.create_command_buffer()),
-      queue(shared.vulkan.get_queue(0)), fence(shared.vulkan.create_fence()),
+      fence(shared.vulkan.create_fence()),
       sampler(shared.vulkan.create_sampler()),
-      output_transfer_buffer(shared.vulkan.create_buffer<char>(
-          {}, get_output_width() * get_output_height() * 4,
-          vk::BufferUsageFlagBits::eTransferDst, vk::SharingMode::eExclusive,
-          vk::MemoryPropertyFlagBits::eHostVisible |
-              vk::MemoryPropertyFlagBits::eHostCoherent)),
-      output_image(
-          shared.vulkan.create_image(get_output_width(), get_output_height(),
-                                     RGBAFormat, vk::ImageTiling::eOptimal,
-                                     vk::ImageUsageFlagBits::eStorage |
-                                         vk::ImageUsageFlagBits::eTransferSrc |
-                                         vk::ImageUsageFlagBits::eSampled)),
-      output_image_view(
-          shared.vulkan.create_image_view(output_image, RGBAFormat)),
-      previous_image(
-          shared.vulkan.create_image(get_output_width(), get_output_height(),
-                                     RGBAFormat, vk::ImageTiling::eOptimal,
-                                     vk::ImageUsageFlagBits::eStorage |
-                                         vk::ImageUsageFlagBits::eTransferSrc |
-                                         vk::ImageUsageFlagBits::eSampled)),
-      previous_image_view(
-          shared.vulkan.create_image_view(previous_image, RGBAFormat)),
-      empty_input(create_input_image(1, 1)),
-      input_resolution_buffer(
-          shared.vulkan.create_buffer<std::pair<float, float>>(
-              {}, max_num_inputs, vk::BufferUsageFlagBits::eUniformBuffer,
-              vk::SharingMode::eExclusive,
-              vk::MemoryPropertyFlagBits::eHostCoherent |
-                  vk::MemoryPropertyFlagBits::eHostVisible)) {
+      output_image(shared.acquire_output_image(get_output_width(),
+                                               get_output_height())),
+      previous_image(shared.acquire_output_image(get_output_width(),
+                                                 get_output_height())),
+      empty_input(shared.create_input_image(1, 1, 4)) {
   static std::mutex pref_mtx;
   static const char *ini_file = nullptr;
   static prefs_page_register_t pref_page = {
@@ -127,7 +633,8 @@ Ogler::Ogler(const clap::host &host)
           return nullptr;
         }
         return PreferencesWindow::create(parent, get_hinstance(), 100, 100,
-                                         TEXT("ogler preferences"), ini_file);
+                                         TEXT("ogler preferences"), ini_file,
+                                         &Ogler::statistics);
       },
       .par_id = 0x9a,
       .par_idstr = "",
@@ -140,51 +647,93 @@ Ogler::Ogler(const clap::host &host)
   if (!ini_file) {
     ini_file = reaper->get_ini_file();
     reaper->plugin_register("prefpage", &pref_page);
+    auto ini_dir = std::filesystem::path(to_wstring(ini_file)).parent_path();
+    shared.shader_cache =
+        std::make_unique<ShaderCache>(ini_dir / "ogler_shader_cache.db");
+    shared.load_pipeline_cache(ini_dir / "ogler_pipeline_cache.bin");
   }
 }
 
 Ogler::~Ogler() {
+  // Compilations refer to this instance. Those no worker started yet are
+  // claimed so that they never run.
+  for (auto &job : compile_jobs) {
+    if (job->claimed.test_and_set()) {
+      job->done.wait();
+    }
+  }
+
   std::unique_lock<std::mutex> lock(video_mutex);
+  drain_frames();
   vproc = nullptr;
+  shared.release_output_image(std::move(output_image));
+  shared.release_output_image(std::move(previous_image));
 }
 
 bool Ogler::activate(double sample_rate, uint32_t min_frames_count,
                      uint32_t max_frames_count) {
-  compiler_error = recompile_shaders();
+  this->sample_rate = sample_rate;
+  {
+    std::unique_lock<std::mutex> lock(video_mutex);
+    Preferences prefs(reaper->get_ini_file());
+    set_frames_in_flight(prefs.get_frames_in_flight());
+  }
 
-  if (!compiler_error.has_value()) {
-    if (editor) {
-      editor->params_changed(data.parameters);
-    }
-    vproc = reaper->create_video_processor();
-    vproc->userdata = this;
-    vproc->process_frame =
-        [](IREAPERVideoProcessor *vproc, const double *parmlist, int nparms,
-           double project_time, double frate, int force_format) {
-          auto plugin = static_cast<Ogler *>(vproc->userdata);
-          return plugin->video_process_frame(
-              std::span{parmlist, static_cast<size_t>(nparms)}, project_time,
-              frate, static_cast<FrameFormat>(force_format));
-        };
-    vproc->get_parameter_value = [](IREAPERVideoProcessor *vproc, int idx,
-                                    double *valueOut) -> bool {
-      auto plugin = static_cast<Ogler *>(vproc->userdata);
-      auto val = plugin->params_get_value(static_cast<clap_id>(idx));
-      if (val.has_value()) {
-        *valueOut = *val;
-        return true;
-      } else {
-        return false;
-      }
-    };
-  } else if (editor) {
-    editor->compiler_error(*compiler_error);
+  // The compilation usually started when the state was loaded, restarts only
+  // need another one if the source changed since
+  if (compile_generation == 0 || data.video_shader != compiled_source) {
+    recompile_shaders();
   }
+  finish_compilation();
+  if (std::exchange(params_rescan_pending, false)) {
+    host.params_rescan(CLAP_PARAM_RESCAN_ALL);
+  }
+  active = true;
+
+  vproc = reaper->create_video_processor();
+  vproc->userdata = this;
+  vproc->process_frame =
+      [](IREAPERVideoProcessor *vproc, const double *parmlist, int nparms,
+         double project_time, double frate, int force_format) {
+        auto plugin = static_cast<Ogler *>(vproc->userdata);
+        return plugin->video_process_frame(
+            std::span{parmlist, static_cast<size_t>(nparms)}, project_time,
+            frate, static_cast<FrameFormat>(force_format));
+      };
+  vproc->get_parameter_value = [](IREAPERVideoProcessor *vproc, int idx,
+                                  double *valueOut) -> bool {
+    auto plugin = static_cast<Ogler *>(vproc->userdata);
+    auto val = plugin->params_get_value(static_cast<clap_id>(idx));
+    if (val.has_value()) {
+      *valueOut = *val;
+      return true;
+    } else {
+      return false;
+    }
+  };
   return true;
 }
 void Ogler::deactivate() {
-  std::unique_lock<std::mutex> lock(video_mutex);
-  vproc = nullptr;
+  {
+    std::unique_lock<std::mutex> lock(video_mutex);
+    drain_frames();
+    vproc = nullptr;
+    active = false;
+  }
+  // Saves after compiling are throttled, this catches the last compiles of a
+  // burst of edits. Nothing is written if the cache did not change.
+  shared.save_pipeline_cache(true);
+}
+
+uint32_t Ogler::latency_get() {
+  auto num_frames = latency_frames.load();
+  if (num_frames == 0) {
+    return 0;
+  }
+
+  // Output frames are returned frames.size() - 1 calls after being submitted
+  auto latency_seconds = num_frames / latency_framerate.load();
+  return static_cast<uint32_t>(latency_seconds * sample_rate);
 }
 
 bool Ogler::start_processing() { return true; }
@@ -211,7 +760,12 @@ clap_process_status Ogler::process(const clap_process_t &process) {
 
 void *Ogler::get_extension(std::string_view id) { return nullptr; }
 
-void Ogler::on_main_thread() {}
+void Ogler::on_main_thread() {
+  if (latency_changed.exchange(false)) {
+    host.latency_changed();
+  }
+  install_compiled_shaders();
+}
 
 void PatchData::deserialize(const clap::istream &s) {
   std::string json_str;
@@ -295,15 +849,282 @@ bool Ogler::state_load(const clap::istream &s) {
   if (editor) {
     editor->reload_source();
   }
+  // Started right away rather than on activation, which the host does for
+  // one instance after the other
+  if (data.video_shader != compiled_source) {
+    recompile_shaders();
+  }
   host.request_restart();
   return true;
 }
 
-std::optional<std::string> Ogler::recompile_shaders() {
-  std::unique_lock<std::mutex> video_lock(video_mutex);
-  std::unique_lock<std::recursive_mutex> params_lock(params_mutex);
+// gmem is not an actual array, its blocks are found through the block table.
+// Indexing it is turned into calls to the accessor, and gmem.length() into
+// the size of global memory. This only applies to the global gmem: comments,
+// member accesses and any scope where a declaration shadows the name are left
+// alone, and so are macro definitions that take a gmem parameter. Glslang only
+// reports line numbers, and line breaks are kept, so errors still point to the
+// right place in the source.
+namespace {
+class GmemRewriter {
+public:
+  explicit GmemRewriter(std::string_view source) : source(source) {}
+
+  std::string rewrite() {
+    res.reserve(source.size());
+    while (pos < source.size()) {
+      auto c = source[pos];
+      if (c == '\n') {
+        at_line_start = true;
+        res += source[pos++];
+      } else if (std::isspace(static_cast<unsigned char>(c))) {
+        res += source[pos++];
+      } else if (skip_comment()) {
+      } else if (c == '#' && at_line_start) {
+        directive();
+      } else if (is_identifier(c)) {
+        at_line_start = false;
+        identifier();
+      } else {
+        at_line_start = false;
+        punctuation();
+      }
+    }
+    return std::move(res);
+  }
+
+private:
+  static bool is_identifier(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+  }
+
+  bool skip_comment() {
+    auto start = source.substr(pos, 2);
+    if (start != "//" && start != "/*") {
+      return false;
+    }
+    auto end = start == "//" ? source.find('\n', pos)
+                             : source.find("*/", pos + 2);
+    end = end == std::string_view::npos ? source.size()
+                                        : end + (start == "//" ? 0 : 2);
+    res += source.substr(pos, end - pos);
+    pos = end;
+    return true;
+  }
+
+  std::string_view read_identifier() {
+    auto start = pos;
+    while (pos < source.size() && is_identifier(source[pos])) {
+      ++pos;
+    }
+    return source.substr(start, pos - start);
+  }
+
+  bool shadowed() const { return !shadows.empty(); }
+
+  // Keeps whitespace and comments between tokens, so that lookahead does not
+  // lose any of them
+  size_t next_token(size_t from) const {
+    while (from < source.size()) {
+      if (std::isspace(static_cast<unsigned char>(source[from]))) {
+        ++from;
+      } else if (source.substr(from, 2) == "//") {
+        from = std::min(source.find('\n', from), source.size());
+      } else if (source.substr(from, 2) == "/*") {
+        auto end = source.find("*/", from + 2);
+        from = end == std::string_view::npos ? source.size() : end + 2;
+      } else {
+        break;
+      }
+    }
+    return from;
+  }
+
+  void identifier() {
+    auto word = read_identifier();
+    auto prev = prev_token;
+    prev_token = word;
+    if (word != "gmem") {
+      return emit(word);
+    }
+
+    // A type (or an array size) before the name makes it a declaration:
+    // a local, a parameter, a struct member or a global of its own
+    bool declaration =
+        prev == "]" || (!prev.empty() && is_identifier(prev.front()) &&
+                        prev != "return" && prev != "case" && prev != "else" &&
+                        prev != "do");
+    if (declaration) {
+      if (paren_depth > 0) {
+        parameter_shadow = true;
+      } else {
+        shadows.push_back(brace_depth);
+      }
+      return emit(word);
+    }
+    if (prev == "." || shadowed()) {
+      return emit(word);
+    }
+
+    auto next = next_token(pos);
+    if (next < source.size() && source[next] == '[') {
+      res += source.substr(pos, next - pos);
+      res += "ogler_gmem(uint(";
+      brackets.push_back(true);
+      pos = next + 1;
+      prev_token = "[";
+    } else if (auto after = next_token(next + 1);
+               next < source.size() && source[next] == '.' &&
+               source.substr(after, 6) == "length") {
+      auto open = next_token(after + 6);
+      auto close = open < source.size() && source[open] == '('
+                       ? next_token(open + 1)
+                       : source.size();
+      if (close < source.size() && source[close] == ')') {
+        res += "int(ogler_gmem_size)";
+        // Only line breaks can be found in between
+        for (auto c : source.substr(pos, close - pos)) {
+          if (c == '\n') {
+            res += c;
+          }
+        }
+        pos = close + 1;
+        prev_token = ")";
+      } else {
+        emit(word);
+      }
+    } else {
+      emit(word);
+    }
+  }
+
+  void emit(std::string_view word) { res += word; }
+
+  void punctuation() {
+    auto c = source[pos++];
+    prev_token = source.substr(pos - 1, 1);
+    switch (c) {
+    case '{':
+      ++brace_depth;
+      if (parameter_shadow && paren_depth == 0) {
+        shadows.push_back(brace_depth);
+        parameter_shadow = false;
+      }
+      break;
+    case '}':
+      if (brace_depth > 0) {
+        --brace_depth;
+      }
+      while (!shadows.empty() && shadows.back() > brace_depth) {
+        shadows.pop_back();
+      }
+      break;
+    case '(':
+      ++paren_depth;
+      break;
+    case ')':
+      if (paren_depth > 0) {
+        --paren_depth;
+      }
+      break;
+    case ';':
+      // A prototype, its parameters go out of scope
+      if (paren_depth == 0) {
+        parameter_shadow = false;
+      }
+      break;
+    case '[':
+      brackets.push_back(false);
+      break;
+    case ']':
+      if (!brackets.empty()) {
+        auto gmem = brackets.back();
+        brackets.pop_back();
+        if (gmem) {
+          res += "))";
+          return;
+        }
+      }
+      break;
+    }
+    res += c;
+  }
+
+  // Only the bodies of #define are rewritten, as that is where gmem can
+  // appear. A macro named gmem, or taking a parameter named gmem, is left
+  // as it is: the former turns off the rewrite for the rest of the source.
+  void directive() {
+    auto end = pos;
+    while (end < source.size() && source[end] != '\n') {
+      end = source[end] == '\\' && end + 1 < source.size() ? end + 2 : end + 1;
+    }
+    auto line = source.substr(pos, end - pos);
+    pos = end;
+
+    GmemRewriter name_reader{line};
+    name_reader.pos = name_reader.next_token(1);
+    if (name_reader.read_identifier() != "define") {
+      res += line;
+      return;
+    }
+    name_reader.pos = name_reader.next_token(name_reader.pos);
+    auto name_start = name_reader.pos;
+    if (name_reader.read_identifier() == "gmem") {
+      shadows.push_back(0);
+    }
+    auto body_start = name_reader.pos;
+    if (body_start < line.size() && line[body_start] == '(') {
+      auto params_end = line.find(')', body_start);
+      if (params_end == std::string_view::npos) {
+        res += line;
+        return;
+      }
+      GmemRewriter params{
+          line.substr(body_start + 1, params_end - body_start - 1)};
+      while (params.pos < params.source.size()) {
+        params.pos = params.next_token(params.pos);
+        if (params.read_identifier() == "gmem") {
+          res += line;
+          return;
+        }
+        ++params.pos;
+      }
+      body_start = params_end + 1;
+    }
+    if (shadowed() || name_start == body_start) {
+      res += line;
+      return;
+    }
+
+    res += line.substr(0, body_start);
+    GmemRewriter body{line.substr(body_start)};
+    res += body.rewrite();
+  }
 
-  auto res = compile_shader({{"<preamble>", R"(#version 460
+  std::string_view source;
+  size_t pos = 0;
+  std::string res;
+  bool at_line_start = true;
+  std::string_view prev_token;
+  size_t brace_depth = 0;
+  size_t paren_depth = 0;
+  // Brace depths of the scopes in which gmem is shadowed
+  std::vector<size_t> shadows;
+  // A parameter named gmem, its scope starts with the function body
+  bool parameter_shadow = false;
+  // Whether each open bracket indexes gmem
+  std::vector<bool> brackets;
+};
+} // namespace
+
+static std::string rewrite_gmem_indexing(std::string_view source) {
+  return GmemRewriter{source}.rewrite();
+}
+
+static void compile_shared_shader(SharedVulkan &shared, SharedShader &shader,
+                                  const std::string &source) {
+  auto res = compile_shader_cached(
+      shared.shader_cache.get(), {{"<preamble>", R"(#version 460
 #define OGLER_PARAMS_BINDING 0
 #define OGLER_PARAMS layout(binding = OGLER_PARAMS_BINDING) uniform Params
 
@@ -312,9 +1133,13 @@ layout (constant_id = 1) const int ogler_version_maj = 0;
 layout (constant_id = 2) const int ogler_version_min = 0;
 layout (constant_id = 3) const int ogler_version_rev = 0;
 
-layout(local_size_x = 1, local_size_y = 1) in;
+layout(local_size_x_id = 4, local_size_y_id = 5) in;
+
+layout (constant_id = 6) const uint ogler_gmem_block_size = 1;
+layout (constant_id = 7) const uint ogler_gmem_output_begin = 0;
+layout (constant_id = 8) const uint ogler_gmem_output_count = 0;
 
-layout(push_constant) uniform UniformBlock {
+layout(binding = 6) uniform UniformBlock {
   vec2 iResolution;
   float iTime;
   float iSampleRate;
@@ -324,55 +1149,294 @@ layout(push_constant) uniform UniformBlock {
 };
 layout(binding = 1) uniform sampler2D iChannel[];
 layout(binding = 2, rgba8) uniform writeonly image2D oChannel;
-layout(binding = 3) buffer readonly Gmem {
-  float gmem[];
-};
 layout(binding = 4) uniform InputSizes {
   vec2 iChannelResolution[];
 };
 layout(binding = 5) uniform sampler2D ogler_previous_frame;
+layout(binding = 7) buffer readonly GmemData {
+  float ogler_gmem_data[];
+};
+layout(binding = 8) buffer readonly GmemBlocks {
+  int ogler_gmem_blocks[];
+};
+
+float ogler_gmem(uint index) {
+  if (index >= ogler_gmem_size) {
+    return 0.0;
+  }
+  int slot = ogler_gmem_blocks[index / ogler_gmem_block_size];
+  // Frames can be recorded before the data buffer grows to include new slots
+  if (slot < 0 ||
+      uint(slot) >= uint(ogler_gmem_data.length()) / ogler_gmem_block_size) {
+    return 0.0;
+  }
+  return ogler_gmem_data[uint(slot) * ogler_gmem_block_size +
+                         index % ogler_gmem_block_size];
+}
+
+layout(binding = 9) buffer writeonly GmemOutput {
+  float ogler_gmem_output_data[];
+};
+
+struct OglerStats {
+  vec4 min_value;
+  vec4 max_value;
+  vec4 mean;
+  uint histogram[64];
+};
+layout(binding = 10) buffer readonly OglerStatsBlock {
+  OglerStats ogler_stats[];
+};
+
+void ogler_gmem_write(uint index, float value) {
+  if (index >= ogler_gmem_output_begin &&
+      index - ogler_gmem_output_begin < ogler_gmem_output_count) {
+    // Other NaNs could be mistaken for elements that were not written
+    if (isnan(value)) {
+      value = uintBitsToFloat(0x7FC00000u);
+    }
+    ogler_gmem_output_data[index - ogler_gmem_output_begin] = value;
+  }
+}
 )"},
-                             {"<source>", data.video_shader},
-                             {"<epilogue>", R"(void main() {
+       {"<source>", rewrite_gmem_indexing(source)},
+       {"<epilogue>", R"(void main() {
+    ivec2 coord = ivec2(gl_GlobalInvocationID.xy);
+    if (any(greaterThanEqual(coord, imageSize(oChannel)))) {
+        return;
+    }
     vec4 fragColor;
-    mainImage(fragColor, vec2(gl_GlobalInvocationID));
-    imageStore(oChannel, ivec2(gl_GlobalInvocationID), fragColor);
+    mainImage(fragColor, vec2(coord));
+    imageStore(oChannel, coord, fragColor);
 })"}},
-                            /*params_binding=*/0);
+      /*params_binding=*/0);
   if (std::holds_alternative<std::string>(res)) {
-    return std::move(std::get<std::string>(res));
+    shader.error = std::move(std::get<std::string>(res));
+    return;
   }
 
-  auto shader_data = std::move(std::get<ShaderData>(res));
+  auto &shader_data = shader.shader_data;
+  shader_data = std::move(std::get<ShaderData>(res));
+  if (shader_data.uses_stats && !shared.vulkan.has_dynamic_sampler_indexing) {
+    shader.error = "ogler_stats is not supported by this device";
+    return;
+  }
 
-  size_t old_num = data.parameters.size();
-  data.parameters.resize(shader_data.parameters.size());
-  for (size_t i = 0; i < shader_data.parameters.size(); ++i) {
-    auto &param = shader_data.parameters[i];
-    data.parameters[i].info = param;
-    if (i >= old_num) {
-      data.parameters[i].value = param.default_value;
-    }
+  {
+    auto [begin, count] = shader_data.gmem_output_range.value_or(
+        std::pair<uint32_t, uint32_t>{0, 0});
+    begin = std::min(begin, gmem_size);
+    shader.gmem_output_range = {begin, std::min(count, gmem_size - begin)};
   }
 
   try {
-    compute = std::make_unique<Compute>(shared.vulkan, shader_data.spirv_code);
+    shader.program = std::make_unique<ComputeProgram>(
+        shared.vulkan, shared.pipeline_cache, shader_data.spirv_code,
+        shared.tile_size, shader.gmem_output_range);
   } catch (vk::Error &e) {
-    return e.what();
+    shader.error = e.what();
   }
+  shared.save_pipeline_cache();
+}
 
-  if (data.parameters.size()) {
-    params_buffer = shared.vulkan.create_buffer<float>(
-        {}, data.parameters.size(), vk::BufferUsageFlagBits::eUniformBuffer,
-        vk::SharingMode::eExclusive,
-        vk::MemoryPropertyFlagBits::eHostCoherent |
-            vk::MemoryPropertyFlagBits::eHostVisible);
-  } else {
-    params_buffer = std::nullopt;
+std::unique_ptr<Ogler::CompiledShader>
+Ogler::compile_shaders(const std::string &source) {
+  auto compiled = std::make_unique<CompiledShader>();
+
+  auto shader = shared.find_shader(source);
+  std::call_once(shader->compiled,
+                 [&]() { compile_shared_shader(shared, *shader, source); });
+  compiled->shader = shader;
+  if (shader->error) {
+    compiled->error = shader->error;
+    return compiled;
   }
 
-  host.params_rescan(CLAP_PARAM_RESCAN_ALL);
-  return std::nullopt;
+  if (shader->shader_data.uses_stats) {
+    try {
+      compiled->stats_program = shared.get_stats_program();
+    } catch (vk::Error &e) {
+      compiled->error = e.what();
+    }
+  }
+  return compiled;
+}
+
+void Ogler::recompile_shaders() {
+  auto generation = ++compile_generation;
+  compiled_source = data.video_shader;
+
+  std::erase_if(compile_jobs, [](std::shared_ptr<CompileJob> &job) {
+    return job->done.wait_for(std::chrono::seconds(0)) ==
+           std::future_status::ready;
+  });
+
+  auto job = std::make_shared<CompileJob>();
+  job->task = std::packaged_task<void()>(
+      [this, source = data.video_shader, generation]() {
+        // Anything escaping would be stored in the future nobody reads, and
+        // the editor would never hear about it
+        std::unique_ptr<CompiledShader> compiled;
+        try {
+          compiled = compile_shaders(source);
+        } catch (std::exception &e) {
+          compiled = std::make_unique<CompiledShader>();
+          compiled->error = e.what();
+        }
+        compiled->generation = generation;
+        {
+          std::unique_lock<std::mutex> lock(compiled_mutex);
+          // Compilations can finish out of order
+          if (compiled_shader && compiled_shader->generation > generation) {
+            return;
+          }
+          std::swap(compiled_shader, compiled);
+        }
+        host.request_callback();
+      });
+  job->done = job->task.get_future();
+  compile_jobs.push_back(job);
+  shared.compile_workers.enqueue([job]() {
+    if (!job->claimed.test_and_set()) {
+      job->task();
+    }
+  });
+}
+
+void Ogler::install_compiled_shaders() {
+  std::unique_ptr<CompiledShader> compiled;
+  {
+    std::unique_lock<std::mutex> lock(compiled_mutex);
+    compiled = std::move(compiled_shader);
+  }
+  if (!compiled || compiled->generation != compile_generation) {
+    return;
+  }
+  install_shaders(*compiled);
+}
+
+void Ogler::finish_compilation() {
+  if (compile_jobs.empty()) {
+    return;
+  }
+  // Runs here rather than waiting behind other instances' compilations if no
+  // worker got to it yet
+  auto &job = compile_jobs.back();
+  if (!job->claimed.test_and_set()) {
+    job->task();
+  }
+  job->done.wait();
+  install_compiled_shaders();
+}
+
+// Changes the host can only be told about with CLAP_PARAM_RESCAN_ALL
+static bool params_restructured(const std::vector<Parameter> &old_params,
+                                const std::vector<ParameterInfo> &new_params) {
+  if (old_params.size() != new_params.size()) {
+    return true;
+  }
+  for (size_t i = 0; i < new_params.size(); ++i) {
+    auto &old_info = old_params[i].info;
+    auto &new_info = new_params[i];
+    if (old_info.minimum_val != new_info.minimum_val ||
+        old_info.maximum_val != new_info.maximum_val ||
+        (old_info.step_size != 0.0f) != (new_info.step_size != 0.0f)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Ogler::install_shaders(CompiledShader &compiled) {
+  std::unique_ptr<Compute> new_compute;
+  std::unique_ptr<StatsCompute> new_stats_compute;
+  if (!compiled.error) {
+    // Before the first activation there are no frames yet, the descriptor
+    // sets are allocated again once there are
+    auto num_frames =
+        static_cast<uint32_t>(std::max<size_t>(frames.size(), 1));
+    try {
+      // Shares ownership of the whole entry, which keeps it in the registry
+      new_compute = std::make_unique<Compute>(
+          shared.vulkan,
+          std::shared_ptr<ComputeProgram>(compiled.shader,
+                                          compiled.shader->program.get()),
+          num_frames);
+      if (compiled.stats_program) {
+        new_stats_compute = std::make_unique<StatsCompute>(
+            shared.vulkan, compiled.stats_program, num_frames);
+      }
+    } catch (vk::Error &e) {
+      compiled.error = e.what();
+    }
+  }
+
+  if (compiled.error) {
+    // The previous shaders, if any, keep rendering
+    compiler_error = std::move(compiled.error);
+    if (editor) {
+      editor->compiler_error(*compiler_error);
+    }
+    return;
+  }
+  compiler_error = std::nullopt;
+
+  auto &shader_data = compiled.shader->shader_data;
+  bool restructured;
+  {
+    std::unique_lock<std::mutex> video_lock(video_mutex);
+    std::unique_lock<std::recursive_mutex> params_lock(params_mutex);
+
+    shader_uses_gmem = shader_data.uses_gmem;
+    shader_gmem_range = shader_data.gmem_range.value_or(
+        std::pair<uint32_t, uint32_t>{0, gmem_size});
+    if (shader_data.used_channels) {
+      shader_channels.reset();
+      for (auto channel : *shader_data.used_channels) {
+        if (channel < max_num_inputs) {
+          shader_channels.set(channel);
+        }
+      }
+    } else {
+      shader_channels.set();
+    }
+    shader_gmem_output_range = compiled.shader->gmem_output_range;
+
+    restructured =
+        params_restructured(data.parameters, shader_data.parameters);
+    size_t old_num = data.parameters.size();
+    data.parameters.resize(shader_data.parameters.size());
+    for (size_t i = 0; i < shader_data.parameters.size(); ++i) {
+      auto &param = shader_data.parameters[i];
+      data.parameters[i].info = param;
+      if (i >= old_num) {
+        data.parameters[i].value = param.default_value;
+      }
+    }
+
+    drain_frames();
+    invalidate_recordings();
+
+    compute = std::move(new_compute);
+    stats_compute = std::move(new_stats_compute);
+
+    for (auto &frame : frames) {
+      frame.params_buffer = create_params_buffer();
+    }
+  }
+
+  if (!restructured) {
+    host.params_rescan(CLAP_PARAM_RESCAN_VALUES | CLAP_PARAM_RESCAN_TEXT |
+                       CLAP_PARAM_RESCAN_INFO);
+  } else if (active) {
+    params_rescan_pending = true;
+    host.request_restart();
+  } else {
+    host.params_rescan(CLAP_PARAM_RESCAN_ALL);
+  }
+  if (editor) {
+    editor->params_changed(data.parameters);
+  }
 }
 
 uint32_t Ogler::audio_ports_count(bool is_input) { return 1; }
@@ -410,6 +1474,8 @@ bool Ogler::gui_create(std::string_view api, bool is_floating) {
 void Ogler::gui_destroy() {
   DestroyWindow(editor);
   editor = {};
+  // Closing the editor usually ends a round of edits
+  shared.save_pipeline_cache(true);
 }
 
 bool Ogler::gui_set_scale(double scale) { return false; }
@@ -446,7 +1512,7 @@ class OglerEditorInterface final : public EditorInterface {
 public:
   OglerEditorInterface(Ogler &plugin) : plugin(plugin) {}
 
-  void recompile_shaders() final { plugin.host.request_restart(); }
+  void recompile_shaders() final { plugin.recompile_shaders(); }
 
   void set_shader_source(const std::string &source) final {
     plugin.data.video_shader = source;
@@ -30,8 +30,15 @@
 #define NOMINMAX
 #include <windows.h>
 
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <filesystem>
+#include <future>
 #include <memory>
 #include <mutex>
+#include <unordered_map>
 
 #include <WDL/wdltypes.h>
 #include <reaper_plugin.h>
@@ -49,8 +56,10 @@
 #include "clap/host.hpp"
 
 #include "compile_shader.hpp"
+#include "ogler_uniforms.hpp"
 #include "sciter_window.hpp"
 #include "vulkan_context.hpp"
+#include "worker_pool.hpp"
 
 #include "IReaper.h"
 
@@ -103,19 +112,317 @@ struct PatchData {
   void serialize(const clap::ostream &);
 };
 
+struct InputImage {
+  Image image;
+  Buffer<char> transfer_buffer;
+  vk::raii::ImageView view;
+};
+
+// Output and previous images swap roles every frame, and are shared between
+// instances through a pool when the output size changes
+struct OutputImage : Image {
+  vk::raii::ImageView view;
+  // Whether the image was already transitioned to eGeneral
+  bool initialized{};
+
+  OutputImage(Image &&img, vk::raii::ImageView &&view)
+      : Image(std::move(img)), view(std::move(view)) {}
+};
+
+class ShaderCache;
+struct SharedShader;
+struct StatsProgram;
+
 struct SharedVulkan {
   VulkanContext vulkan;
 
+  // Size of the workgroups the video shaders are dispatched in, picked once
+  // for the physical device in use
+  vk::Extent2D tile_size;
+
+  // Used to split frame copies and gmem conversion across cores. CLAP's
+  // thread pool extension can only be used from process(), which doesn't
+  // cover video processing.
+  WorkerPool workers;
+  // Shader compilations run on workers of their own, as a running one can't be
+  // preempted by frame copies and would leave them with fewer workers while
+  // the shader is being edited
+  WorkerPool compile_workers;
+
+  // Opened by the first instance, which is the first that knows where REAPER
+  // keeps its ini file. Compilations skip the cache until then.
+  std::unique_ptr<ShaderCache> shader_cache;
+
+  // Used for every pipeline, so that the driver only compiles each shader
+  // once, and saved next to REAPER's ini file so that this holds across
+  // sessions too. Loaded along with the shader cache.
+  vk::raii::PipelineCache pipeline_cache;
+  std::mutex pipeline_cache_mutex;
+  std::filesystem::path pipeline_cache_path;
+  std::chrono::steady_clock::time_point pipeline_cache_saved_at;
+  size_t pipeline_cache_saved_size{};
+
+  void load_pipeline_cache(const std::filesystem::path &path);
+  // Writes the cache back if it changed, at most once a minute unless forced.
+  // Forced when an instance is deactivated or closes its editor, so that the
+  // throttling does not hold changes back until REAPER exits.
+  void save_pipeline_cache(bool force = false);
+
+  // Compiled video shaders by source, so that instances running the same
+  // shader compile it once and share its pipeline. Only the instances keep
+  // entries alive.
+  std::mutex shaders_mutex;
+  std::unordered_map<std::string, std::weak_ptr<SharedShader>> shaders;
+  // Same for the ogler_stats passes, which don't depend on the shader
+  std::mutex stats_program_mutex;
+  std::weak_ptr<StatsProgram> stats_program;
+
+  // The entry for source, which might still need to be compiled
+  std::shared_ptr<SharedShader> find_shader(const std::string &source);
+  std::shared_ptr<StatsProgram> get_stats_program();
+
+  // Input images no frame is using anymore, oldest first, so that inputs
+  // changing size don't need new allocations on the video thread
+  static constexpr size_t max_pooled_inputs = 16;
+  std::mutex input_pool_mutex;
+  std::vector<InputImage> input_pool;
+  // Same, for output images
+  static constexpr size_t max_pooled_outputs = 8;
+  std::mutex output_pool_mutex;
+  std::vector<OutputImage> output_pool;
+
+  // All instances submit to the same queue, which needs external
+  // synchronization
+  std::mutex queue_mutex;
+  vk::raii::Queue queue;
+
+  // gmem is uploaded with its own submission so that the transfer buffer can
+  // be reused while frames reading gmem_buffer are still in flight
+  std::mutex gmem_mutex;
+  vk::raii::CommandBuffer gmem_command_buffer;
+  vk::raii::Fence gmem_fence;
+  bool gmem_pending{};
+
+  // gmem is stored compactly: each allocated block gets a slot in
+  // gmem_buffer, and gmem_block_table maps block indices to slots (or -1).
+  // gmem_buffer grows with the number of allocated blocks.
+  std::vector<int32_t> gmem_slots;
+  uint32_t gmem_num_slots{};
+  uint32_t gmem_capacity;
   Buffer<float> gmem_transfer_buffer;
-  Buffer<float> gmem_buffer;
+  // Frames in flight hold on to the buffer they were recorded with, so a
+  // buffer that was replaced is freed once the last of them retires
+  std::shared_ptr<Buffer<float>> gmem_buffer;
+  // Updated by the gmem submission, which waits for the frames submitted
+  // before it to be done reading the table
+  Buffer<int32_t> gmem_block_table;
+  bool gmem_block_table_dirty = true;
+  // Buffers the pending gmem submission copies from after growing
+  std::vector<std::shared_ptr<Buffer<float>>> gmem_retired_buffers;
+  // Changes whenever gmem_buffer is replaced
+  uint64_t gmem_generation{};
+
+  // Raw snapshot of each gmem block, allocated along with the blocks
+  // themselves. Only chunks that differ from it are uploaded again.
+  static constexpr size_t gmem_chunk_size = 4096;
+  std::vector<std::unique_ptr<double[]>> gmem_shadow;
+  // Chunks of gmem_shadow that changed since the last flush, as
+  // [first, last) item ranges
+  std::vector<std::pair<size_t, size_t>> gmem_dirty_chunks;
+
+  // How long the EEL mutex is held while taking gmem snapshots, since it
+  // blocks every JSFX in the project
+  struct LockStats {
+    std::atomic<int64_t> last_ns{};
+    std::atomic<int64_t> max_ns{};
+    std::atomic<int64_t> total_ns{};
+    std::atomic<int64_t> count{};
+
+    void record(std::chrono::nanoseconds duration);
+  } gmem_lock_stats;
+
+  // Human readable runtime statistics, shown in the preferences page
+  std::string statistics();
 
   SharedVulkan();
+  ~SharedVulkan();
+
+  void submit(vk::raii::CommandBuffer &command_buffer, vk::Fence fence);
+  void submit(std::span<const vk::CommandBuffer> command_buffers,
+              vk::Fence fence);
+
+  InputImage create_input_image(int w, int h, int transfer_size);
+  // Reuses a pooled image of the same size and a transfer buffer at least as
+  // large if there is one
+  InputImage acquire_input_image(int w, int h, int transfer_size);
+  // The image must not be in use by the GPU anymore
+  void release_input_image(InputImage image);
+
+  OutputImage acquire_output_image(int w, int h);
+  // The image must not be in use by the GPU anymore
+  void release_output_image(OutputImage image);
+
+  // Video tick the snapshot was last taken for: every instance renders the
+  // same tick, and only the first one needs to upload gmem
+  struct GmemTick {
+    double project_time;
+    std::chrono::steady_clock::time_point taken_at;
+    std::chrono::steady_clock::duration frame_duration;
+    // Ranges of gmem snapshotted during this tick
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+  };
+  std::optional<GmemTick> gmem_tick;
+
+  // Whether gmem[begin, begin + count) was already snapshotted for the video
+  // tick at project_time, in which case there is nothing to upload
+  bool is_gmem_current(double project_time, double framerate, uint32_t begin,
+                       uint32_t count);
+
+  // Copies the changed parts of gmem[begin, begin + count) into gmem_shadow.
+  // This is the only step that needs the EEL mutex.
+  void snapshot_gmem(double **blocks, uint32_t begin, uint32_t count,
+                     double project_time, double framerate);
+
+  // Converts the changed parts of the snapshot and uploads them to
+  // gmem_buffer. Frames submitted afterwards need a transfer -> compute
+  // barrier before reading gmem_buffer.
+  void flush_gmem();
+
+  struct GmemBindings {
+    std::shared_ptr<Buffer<float>> buffer;
+    vk::Buffer block_table;
+    uint64_t generation;
+  };
+  GmemBindings gmem_bindings();
 };
 
-struct InputImage {
-  Image image;
-  Buffer<char> transfer_buffer;
-  vk::raii::ImageView view;
+// Where the pixels of a frame live in memory the device can copy from or to
+struct FrameBufferRegion {
+  vk::Buffer buffer;
+  vk::DeviceSize offset{};
+  // In pixels, 0 means tightly packed
+  uint32_t row_length{};
+  // REAPER's own frame memory, which is different every frame. Copies from or
+  // to it are recorded for each frame rather than being part of the replayed
+  // recordings.
+  bool imported{};
+};
+
+// REAPER frame memory imported as a buffer, only valid while the frame
+// referencing it is in flight
+struct ImportedFrame {
+  const char *bits;
+  size_t size;
+  HostBuffer buffer;
+};
+
+struct FrameInput {
+  InputImage *image{};
+  FrameBufferRegion source;
+};
+
+// Describes what a recorded command buffer does: as long as it matches, the
+// same commands can be submitted again and only mapped memory needs updating
+struct RecordedFrameKey {
+  vk::Pipeline pipeline;
+  vk::Image output_image;
+  vk::Image previous_image;
+  int output_width;
+  int output_height;
+  uint32_t output_row_length;
+  uint64_t gmem_generation;
+  std::array<std::pair<int, int>, max_num_inputs> input_sizes;
+  std::array<uint32_t, max_num_inputs> input_row_lengths;
+  // Imported inputs and outputs are copied outside of the recording
+  std::bitset<max_num_inputs> imported_inputs;
+  bool output_imported;
+
+  bool operator==(const RecordedFrameKey &) const = default;
+};
+
+// Contents of a Compute descriptor set, laid out for its update template
+struct ComputeDescriptors {
+  vk::DescriptorBufferInfo params;
+  std::array<vk::DescriptorImageInfo, max_num_inputs> channels;
+  vk::DescriptorImageInfo output;
+  vk::DescriptorBufferInfo input_sizes;
+  vk::DescriptorImageInfo previous_frame;
+  vk::DescriptorBufferInfo uniforms;
+  vk::DescriptorBufferInfo gmem_data;
+  vk::DescriptorBufferInfo gmem_blocks;
+  vk::DescriptorBufferInfo gmem_output;
+  vk::DescriptorBufferInfo stats;
+
+  bool operator==(const ComputeDescriptors &) const = default;
+};
+
+// Contents of a StatsCompute descriptor set, laid out for its update template
+struct StatsDescriptors {
+  std::array<vk::DescriptorImageInfo, max_num_inputs> channels;
+  vk::DescriptorBufferInfo partials;
+  vk::DescriptorBufferInfo stats;
+
+  bool operator==(const StatsDescriptors &) const = default;
+};
+
+struct RecordedFrame {
+  vk::raii::CommandBuffer command_buffer;
+  std::optional<RecordedFrameKey> key;
+  // What the descriptor sets of this recording were last updated with. Only
+  // meaningful while key is set, as resources may have been destroyed and
+  // their handles reused otherwise.
+  ComputeDescriptors descriptors{};
+  StatsDescriptors stats_descriptors{};
+};
+
+// Everything that is written while recording a frame, so that a new frame can
+// be prepared while previous ones are still being processed by the GPU
+struct FrameResources {
+  // Output and previous images are swapped every frame, so there are usually
+  // two different configurations to keep around
+  std::array<RecordedFrame, 2> recordings;
+  size_t next_recording{};
+  vk::raii::Fence fence;
+  // Recorded for every frame and submitted along with the replayed recording:
+  // layout transitions of new output images and uploads from imported inputs
+  // before it, downloads into an imported output after it
+  vk::raii::CommandBuffer setup_command_buffer;
+  vk::raii::CommandBuffer readback_command_buffer;
+  // Output images replaced while this frame was in flight, returned to the
+  // pool once it is retired
+  std::vector<OutputImage> retired_outputs;
+
+  std::optional<Buffer<char>> output_transfer_buffer;
+  // Indexed by channel, and kept while the channel is missing so that it is
+  // still there when it comes back
+  std::array<std::optional<InputImage>, max_num_inputs> input_images;
+  // REAPER's own frame memory, used in place of the transfer buffers when
+  // possible. Only valid until the frame is retired
+  std::vector<ImportedFrame> imported_frames;
+  bool output_imported{};
+  std::optional<Buffer<float>> params_buffer;
+  // Written by the shader through ogler_gmem_write(), and copied into gmem
+  // once the frame is retired. Always bound, even if the window is empty.
+  std::optional<Buffer<float>> gmem_output_buffer;
+  std::pair<uint32_t, uint32_t> gmem_output_range{};
+  // gmem buffer the frame in flight reads, kept alive until it is retired
+  std::shared_ptr<Buffer<float>> gmem_buffer;
+  // Only allocated for shaders that read ogler_stats
+  std::optional<Buffer<ChannelStats>> stats_buffer;
+  std::optional<Buffer<ChannelStats>> stats_partials_buffer;
+  Buffer<std::pair<float, float>> input_resolution_buffer;
+  Buffer<Uniforms> uniforms_buffer;
+
+  IVideoFrame *output_frame{};
+  bool pending{};
+
+  // Must be called whenever a resource referenced by the recordings is
+  // destroyed
+  void invalidate() {
+    for (auto &recording : recordings) {
+      recording.key = std::nullopt;
+    }
+  }
 };
 
 class Editor;
@@ -133,31 +440,77 @@ class Ogler final {
   std::optional<int> shader_output_width;
   std::optional<int> shader_output_height;
 
+  // What the current shader reads from gmem, as (first index, count)
+  bool shader_uses_gmem{};
+  std::pair<uint32_t, uint32_t> shader_gmem_range{0, gmem_size};
+  // Input channels the current shader reads, the others are not even
+  // requested from REAPER
+  std::bitset<max_num_inputs> shader_channels;
+  // What the current shader writes back to gmem, as (first index, count)
+  std::pair<uint32_t, uint32_t> shader_gmem_output_range{};
+  // Values read back from the last retired frame, written to gmem at the
+  // start of the next video_process_frame call. gmem_output_begin is where
+  // the window started for the shader that produced them.
+  uint32_t gmem_output_begin{};
+  std::vector<double> gmem_output_values;
+  // Runs of elements the shader wrote, as [first, last) offsets in the window
+  std::vector<std::pair<uint32_t, uint32_t>> gmem_output_written;
+
   static SharedVulkan &get_shared_vulkan();
+  static std::string statistics();
 
   SharedVulkan &shared;
   vk::raii::Sampler sampler;
   vk::raii::CommandBuffer command_buffer;
-  vk::raii::Queue queue;
   vk::raii::Fence fence;
 
-  Buffer<char> output_transfer_buffer;
-  Image output_image;
-  vk::raii::ImageView output_image_view;
-  Image previous_image;
-  vk::raii::ImageView previous_image_view;
+  OutputImage output_image;
+  OutputImage previous_image;
 
   InputImage empty_input;
-  std::vector<InputImage> input_images;
 
-  std::optional<Buffer<float>> params_buffer;
+  static constexpr int max_frames_in_flight = 3;
+  std::vector<FrameResources> frames;
+  size_t next_frame{};
 
-  Buffer<std::pair<float, float>> input_resolution_buffer;
+  double sample_rate{};
+  // frames.size() - 1, which the main thread reads without taking video_mutex
+  std::atomic<size_t> latency_frames{};
+  // Framerate used to express the pipelining latency in samples
+  std::atomic<double> latency_framerate{30.0};
+  // Set by the video thread when the framerate changes, the host is told
+  // about it from the main thread
+  std::atomic<bool> latency_changed{};
 
   struct Compute;
   std::unique_ptr<Compute> compute;
-
-  IVideoFrame *output_frame{};
+  struct StatsCompute;
+  std::unique_ptr<StatsCompute> stats_compute;
+
+  // Shaders are compiled on the compile workers as soon as their source is
+  // known, and installed on the main thread once done, so that the previous
+  // ones keep rendering meanwhile and instances loaded together compile in
+  // parallel
+  struct CompiledShader;
+  std::mutex compiled_mutex;
+  std::unique_ptr<CompiledShader> compiled_shader;
+  // Incremented whenever a compilation starts, the results of older ones are
+  // discarded
+  uint64_t compile_generation{};
+  // Source of the last compilation started
+  std::string compiled_source;
+  // Run by whichever gets to it first: a worker, or activate() needing the
+  // result, so that it never waits behind other instances' compilations
+  struct CompileJob {
+    std::atomic_flag claimed;
+    std::packaged_task<void()> task;
+    std::future<void> done;
+  };
+  std::vector<std::shared_ptr<CompileJob>> compile_jobs;
+  // Parameters were added or removed while active, which the host can only be
+  // told about on the next activation
+  bool params_rescan_pending{};
+  bool active{};
 
   WindowHandle<Editor> editor{};
 
@@ -171,7 +524,33 @@ class Ogler final {
 
   std::optional<std::string> compiler_error;
 
-  InputImage create_input_image(int w, int h);
+  std::unique_ptr<CompiledShader> compile_shaders(const std::string &source);
+  // Installs the result of the last compilation, if it's done and wasn't yet
+  void install_compiled_shaders();
+  void install_shaders(CompiledShader &compiled);
+  // Waits for the last compilation and installs its result
+  void finish_compilation();
+
+  FrameResources create_frame_resources();
+  // Sized for the parameters of the installed shader, if it has any
+  std::optional<Buffer<float>> create_params_buffer();
+  void set_frames_in_flight(int num_frames);
+  std::optional<FrameBufferRegion> import_frame(FrameResources &resources,
+                                                IVideoFrame *frame);
+  IVideoFrame *retire_frame(FrameResources &frame);
+  void release_frame_resources(FrameResources &frame);
+  void read_back_gmem_output(FrameResources &frame);
+  void write_back_gmem();
+  void drain_frames();
+  void invalidate_recordings();
+  void record_frame(FrameResources &frame, RecordedFrame &recording,
+                    size_t descriptor_set,
+                    const SharedVulkan::GmemBindings &gmem_bindings,
+                    const std::array<FrameInput, max_num_inputs> &inputs,
+                    const FrameBufferRegion &output);
+  void record_stats(vk::raii::CommandBuffer &command_buffer,
+                    size_t descriptor_set,
+                    const std::array<FrameInput, max_num_inputs> &inputs);
 
   template <typename Func> void one_shot_execute(Func f) {
     {
@@ -183,11 +562,7 @@ class Ogler final {
     f();
     command_buffer.end();
 
-    vk::SubmitInfo SubmitInfo{
-        .commandBufferCount = 1,
-        .pCommandBuffers = &*command_buffer,
-    };
-    queue.submit({SubmitInfo}, *fence);
+    shared.submit(command_buffer, *fence);
     auto res = shared.vulkan.device.waitForFences({*fence}, // List of fences
                                                   true,     // Wait All
                                                   uint64_t(-1)); // Timeout
@@ -224,7 +599,8 @@ public:
   Ogler(const clap::host &host);
   ~Ogler();
 
-  std::optional<std::string> recompile_shaders();
+  // Starts compiling data.video_shader in the background
+  void recompile_shaders();
 
   bool init();
   bool activate(double sample_rate, uint32_t min_frames_count,
@@ -239,6 +615,8 @@ public:
   bool state_save(const clap::ostream &os);
   bool state_load(const clap::istream &os);
 
+  uint32_t latency_get();
+
   void *get_extension(std::string_view id);
   void on_main_thread();
 
@@ -35,17 +35,48 @@ struct SpecializationData {
   int ogler_version_maj;
   int ogler_version_min;
   int ogler_version_rev;
+  uint32_t tile_size_x;
+  uint32_t tile_size_y;
+  uint32_t gmem_block_size;
+  uint32_t gmem_output_begin;
+  uint32_t gmem_output_count;
 };
 
-struct Ogler::Compute {
+template <typename T>
+vk::DescriptorUpdateTemplateEntry
+descriptor_template_entry(uint32_t binding, vk::DescriptorType type,
+                          size_t offset, uint32_t count = 1) {
+  return {
+      .dstBinding = binding,
+      .descriptorCount = count,
+      .descriptorType = type,
+      .offset = offset,
+      .stride = sizeof(T),
+  };
+}
+
+inline vk::raii::DescriptorUpdateTemplate create_descriptor_template(
+    VulkanContext &ctx, vk::raii::DescriptorSetLayout &layout,
+    std::span<const vk::DescriptorUpdateTemplateEntry> entries) {
+  vk::DescriptorUpdateTemplateCreateInfo create_info{
+      .descriptorUpdateEntryCount = static_cast<uint32_t>(entries.size()),
+      .pDescriptorUpdateEntries = entries.data(),
+      .templateType = vk::DescriptorUpdateTemplateType::eDescriptorSet,
+      .descriptorSetLayout = *layout,
+  };
+  return ctx.device.createDescriptorUpdateTemplate(create_info);
+}
+
+// Everything about a video shader's pipeline that doesn't depend on the
+// instance running it, shared between instances through SharedShader
+struct ComputeProgram {
   vk::raii::ShaderModule shader;
   vk::raii::DescriptorSetLayout descriptor_set_layout;
-  vk::raii::DescriptorPool descriptor_pool;
-  vk::raii::DescriptorSet descriptor_set;
+  // Writes a whole ComputeDescriptors at once
+  vk::raii::DescriptorUpdateTemplate descriptor_template;
 
-  vk::raii::PipelineCache pipeline_cache;
   vk::raii::PipelineLayout pipeline_layout;
-  std::array<vk::SpecializationMapEntry, 4> pipeline_spec_entries{
+  std::array<vk::SpecializationMapEntry, 9> pipeline_spec_entries{
       // ogler_gmem_size
       vk::SpecializationMapEntry{
           .constantID = 0,
@@ -74,13 +105,43 @@ struct Ogler::Compute {
               offsetof(SpecializationData, ogler_version_rev)),
           .size = sizeof(SpecializationData::ogler_version_rev),
       },
+      // local_size_x
+      vk::SpecializationMapEntry{
+          .constantID = 4,
+          .offset =
+              static_cast<uint32_t>(offsetof(SpecializationData, tile_size_x)),
+          .size = sizeof(SpecializationData::tile_size_x),
+      },
+      // local_size_y
+      vk::SpecializationMapEntry{
+          .constantID = 5,
+          .offset =
+              static_cast<uint32_t>(offsetof(SpecializationData, tile_size_y)),
+          .size = sizeof(SpecializationData::tile_size_y),
+      },
+      // ogler_gmem_block_size
+      vk::SpecializationMapEntry{
+          .constantID = 6,
+          .offset = static_cast<uint32_t>(
+              offsetof(SpecializationData, gmem_block_size)),
+          .size = sizeof(SpecializationData::gmem_block_size),
+      },
+      // ogler_gmem_output_begin
+      vk::SpecializationMapEntry{
+          .constantID = 7,
+          .offset = static_cast<uint32_t>(
+              offsetof(SpecializationData, gmem_output_begin)),
+          .size = sizeof(SpecializationData::gmem_output_begin),
+      },
+      // ogler_gmem_output_count
+      vk::SpecializationMapEntry{
+          .constantID = 8,
+          .offset = static_cast<uint32_t>(
+              offsetof(SpecializationData, gmem_output_count)),
+          .size = sizeof(SpecializationData::gmem_output_count),
+      },
   };
-  SpecializationData pipeline_spec_data{
-      .gmem_size = gmem_size,
-      .ogler_version_maj = version::major,
-      .ogler_version_min = version::minor,
-      .ogler_version_rev = version::revision,
-  };
+  SpecializationData pipeline_spec_data;
   vk::SpecializationInfo pipeline_spec_info{
       .mapEntryCount = static_cast<uint32_t>(pipeline_spec_entries.size()),
       .pMapEntries = pipeline_spec_entries.data(),
@@ -106,13 +167,6 @@ struct Ogler::Compute {
             .descriptorCount = 1,
             .stageFlags = vk::ShaderStageFlagBits::eCompute,
         },
-        // gmem
-        {
-            .binding = 3,
-            .descriptorType = vk::DescriptorType::eStorageBuffer,
-            .descriptorCount = 1,
-            .stageFlags = vk::ShaderStageFlagBits::eCompute,
-        },
         // iChannelResolution[]
         {
             .binding = 4,
@@ -134,6 +188,41 @@ struct Ogler::Compute {
             .descriptorCount = 1,
             .stageFlags = vk::ShaderStageFlagBits::eCompute,
         },
+        // UniformBlock
+        {
+            .binding = 6,
+            .descriptorType = vk::DescriptorType::eUniformBuffer,
+            .descriptorCount = 1,
+            .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        },
+        // GmemData
+        {
+            .binding = 7,
+            .descriptorType = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = 1,
+            .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        },
+        // GmemBlocks
+        {
+            .binding = 8,
+            .descriptorType = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = 1,
+            .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        },
+        // GmemOutput
+        {
+            .binding = 9,
+            .descriptorType = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = 1,
+            .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        },
+        // OglerStatsBlock
+        {
+            .binding = 10,
+            .descriptorType = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = 1,
+            .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        },
     };
     vk::DescriptorSetLayoutCreateInfo layout_info{
         .bindingCount = static_cast<uint32_t>(bindings.size()),
@@ -143,72 +232,284 @@ struct Ogler::Compute {
     return ctx.device.createDescriptorSetLayout(layout_info);
   }
 
+  static inline vk::raii::DescriptorUpdateTemplate
+  create_descriptor_template(VulkanContext &ctx,
+                             vk::raii::DescriptorSetLayout &layout) {
+    using BufferInfo = vk::DescriptorBufferInfo;
+    using ImageInfo = vk::DescriptorImageInfo;
+    using Type = vk::DescriptorType;
+    std::array entries = {
+        descriptor_template_entry<BufferInfo>(
+            0, Type::eUniformBuffer, offsetof(ComputeDescriptors, params)),
+        descriptor_template_entry<ImageInfo>(
+            1, Type::eCombinedImageSampler,
+            offsetof(ComputeDescriptors, channels), max_num_inputs),
+        descriptor_template_entry<ImageInfo>(
+            2, Type::eStorageImage, offsetof(ComputeDescriptors, output)),
+        descriptor_template_entry<BufferInfo>(
+            4, Type::eUniformBuffer,
+            offsetof(ComputeDescriptors, input_sizes)),
+        descriptor_template_entry<ImageInfo>(
+            5, Type::eCombinedImageSampler,
+            offsetof(ComputeDescriptors, previous_frame)),
+        descriptor_template_entry<BufferInfo>(
+            6, Type::eUniformBuffer, offsetof(ComputeDescriptors, uniforms)),
+        descriptor_template_entry<BufferInfo>(
+            7, Type::eStorageBuffer, offsetof(ComputeDescriptors, gmem_data)),
+        descriptor_template_entry<BufferInfo>(
+            8, Type::eStorageBuffer,
+            offsetof(ComputeDescriptors, gmem_blocks)),
+        descriptor_template_entry<BufferInfo>(
+            9, Type::eStorageBuffer,
+            offsetof(ComputeDescriptors, gmem_output)),
+        descriptor_template_entry<BufferInfo>(
+            10, Type::eStorageBuffer, offsetof(ComputeDescriptors, stats)),
+    };
+    return ogler::create_descriptor_template(ctx, layout, entries);
+  }
+
+  ComputeProgram(VulkanContext &ctx, vk::raii::PipelineCache &pipeline_cache,
+                 const std::vector<unsigned> &shader_code,
+                 vk::Extent2D tile_size,
+                 std::pair<uint32_t, uint32_t> gmem_output_range)
+      : shader(ctx.create_shader_module(shader_code)),
+        descriptor_set_layout(create_descriptor_set_layout(ctx)),
+        descriptor_template(
+            create_descriptor_template(ctx, descriptor_set_layout)),
+        pipeline_layout(ctx.create_pipeline_layout(descriptor_set_layout,
+                                                   /*push_constants_size=*/0)),
+        pipeline_spec_data{
+            .gmem_size = gmem_size,
+            .ogler_version_maj = version::major,
+            .ogler_version_min = version::minor,
+            .ogler_version_rev = version::revision,
+            .tile_size_x = tile_size.width,
+            .tile_size_y = tile_size.height,
+            .gmem_block_size = NSEEL_RAM_ITEMSPERBLOCK,
+            .gmem_output_begin = gmem_output_range.first,
+            .gmem_output_count = gmem_output_range.second,
+        },
+        pipeline(ctx.create_compute_pipeline(shader, "main", pipeline_layout,
+                                             pipeline_cache,
+                                             &pipeline_spec_info)) {}
+};
+
+struct Ogler::Compute {
+  std::shared_ptr<ComputeProgram> program;
+  vk::raii::DescriptorPool descriptor_pool;
+  // One descriptor set per recording of each frame in flight
+  std::vector<vk::raii::DescriptorSet> descriptor_sets;
+
   static inline vk::raii::DescriptorPool
-  create_descriptor_pool(VulkanContext &ctx) {
+  create_descriptor_pool(VulkanContext &ctx, uint32_t num_sets) {
     std::vector<vk::DescriptorPoolSize> pool_sizes = {
         // Input texture
         {
             .type = vk::DescriptorType::eCombinedImageSampler,
-            .descriptorCount = max_num_inputs,
+            .descriptorCount = max_num_inputs * num_sets,
         },
         // Output texture
         {
             .type = vk::DescriptorType::eStorageImage,
-            .descriptorCount = 1,
-        },
-        // gmem
-        {
-            .type = vk::DescriptorType::eStorageBuffer,
-            .descriptorCount = 1,
+            .descriptorCount = num_sets,
         },
         // iChannelResolution[]
         {
             .type = vk::DescriptorType::eUniformBuffer,
-            .descriptorCount = 1,
+            .descriptorCount = num_sets,
         },
         // ogler_previous_frame
         {
             .type = vk::DescriptorType::eCombinedImageSampler,
-            .descriptorCount = 1,
+            .descriptorCount = num_sets,
         },
         // Params
         {
             .type = vk::DescriptorType::eUniformBuffer,
-            .descriptorCount = 1,
+            .descriptorCount = num_sets,
+        },
+        // UniformBlock
+        {
+            .type = vk::DescriptorType::eUniformBuffer,
+            .descriptorCount = num_sets,
+        },
+        // GmemData, GmemBlocks, GmemOutput and OglerStatsBlock
+        {
+            .type = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = num_sets * 4,
         },
     };
 
     vk::DescriptorPoolCreateInfo create_info{
         .flags = vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
-        .maxSets = 1,
+        .maxSets = num_sets,
         .poolSizeCount = static_cast<uint32_t>(pool_sizes.size()),
         .pPoolSizes = pool_sizes.data(),
     };
     return ctx.device.createDescriptorPool(create_info);
   }
 
-  static inline vk::raii::DescriptorSet
-  create_descriptor_set(VulkanContext &ctx, vk::raii::DescriptorPool &pool,
-                        vk::raii::DescriptorSetLayout &layout) {
+  static inline std::vector<vk::raii::DescriptorSet>
+  create_descriptor_sets(VulkanContext &ctx, vk::raii::DescriptorPool &pool,
+                         vk::raii::DescriptorSetLayout &layout,
+                         uint32_t num_sets) {
+    std::vector<vk::DescriptorSetLayout> layouts(num_sets, *layout);
     vk::DescriptorSetAllocateInfo alloc_info{
         .descriptorPool = *pool,
-        .descriptorSetCount = 1,
-        .pSetLayouts = &*layout,
+        .descriptorSetCount = num_sets,
+        .pSetLayouts = layouts.data(),
     };
-    return std::move(ctx.device.allocateDescriptorSets(alloc_info).front());
+    return ctx.device.allocateDescriptorSets(alloc_info);
   }
 
-  Compute(VulkanContext &ctx, const std::vector<unsigned> &shader_code)
-      : shader(ctx.create_shader_module(shader_code)),
+  Compute(VulkanContext &ctx, std::shared_ptr<ComputeProgram> program,
+          uint32_t num_frames)
+      : program(std::move(program)),
+        descriptor_pool(create_descriptor_pool(ctx, num_frames * 2)),
+        descriptor_sets(create_descriptor_sets(
+            ctx, descriptor_pool, this->program->descriptor_set_layout,
+            num_frames * 2)) {}
+};
+
+// SPIR-V of the passes computing ogler_stats, compiled on first use
+const std::vector<unsigned> &stats_shader_code(bool final_pass);
+
+// Pipelines reducing every input to a ChannelStats. They are the same for all
+// shaders, so a single one is shared by every instance reading ogler_stats.
+struct StatsProgram {
+  vk::raii::ShaderModule partial_shader;
+  vk::raii::ShaderModule final_shader;
+  vk::raii::DescriptorSetLayout descriptor_set_layout;
+  // Writes a whole StatsDescriptors at once
+  vk::raii::DescriptorUpdateTemplate descriptor_template;
+
+  vk::raii::PipelineLayout pipeline_layout;
+  vk::raii::Pipeline partial_pipeline;
+  vk::raii::Pipeline final_pipeline;
+
+  static inline vk::raii::DescriptorSetLayout
+  create_descriptor_set_layout(VulkanContext &ctx) {
+    std::vector<vk::DescriptorSetLayoutBinding> bindings = {
+        // Input textures
+        {
+            .binding = 0,
+            .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+            .descriptorCount = max_num_inputs,
+            .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        },
+        // Partials
+        {
+            .binding = 1,
+            .descriptorType = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = 1,
+            .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        },
+        // Stats
+        {
+            .binding = 2,
+            .descriptorType = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = 1,
+            .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        },
+    };
+    vk::DescriptorSetLayoutCreateInfo layout_info{
+        .bindingCount = static_cast<uint32_t>(bindings.size()),
+        .pBindings = bindings.data(),
+    };
+
+    return ctx.device.createDescriptorSetLayout(layout_info);
+  }
+
+  static inline vk::raii::DescriptorUpdateTemplate
+  create_descriptor_template(VulkanContext &ctx,
+                             vk::raii::DescriptorSetLayout &layout) {
+    std::array entries = {
+        descriptor_template_entry<vk::DescriptorImageInfo>(
+            0, vk::DescriptorType::eCombinedImageSampler,
+            offsetof(StatsDescriptors, channels), max_num_inputs),
+        descriptor_template_entry<vk::DescriptorBufferInfo>(
+            1, vk::DescriptorType::eStorageBuffer,
+            offsetof(StatsDescriptors, partials)),
+        descriptor_template_entry<vk::DescriptorBufferInfo>(
+            2, vk::DescriptorType::eStorageBuffer,
+            offsetof(StatsDescriptors, stats)),
+    };
+    return ogler::create_descriptor_template(ctx, layout, entries);
+  }
+
+  StatsProgram(VulkanContext &ctx, vk::raii::PipelineCache &pipeline_cache)
+      : partial_shader(ctx.create_shader_module(stats_shader_code(false))),
+        final_shader(ctx.create_shader_module(stats_shader_code(true))),
         descriptor_set_layout(create_descriptor_set_layout(ctx)),
-        descriptor_pool(create_descriptor_pool(ctx)),
-        descriptor_set(
-            create_descriptor_set(ctx, descriptor_pool, descriptor_set_layout)),
-        pipeline_cache(ctx.create_pipeline_cache()),
-        pipeline_layout(ctx.create_pipeline_layout(descriptor_set_layout,
-                                                   sizeof(Uniforms))),
-        pipeline(ctx.create_compute_pipeline(shader, "main", pipeline_layout,
-                                             pipeline_cache,
-                                             &pipeline_spec_info)) {}
+        descriptor_template(
+            create_descriptor_template(ctx, descriptor_set_layout)),
+        pipeline_layout(ctx.create_pipeline_layout(
+            descriptor_set_layout,
+            /*push_constants_size=*/sizeof(uint32_t))),
+        partial_pipeline(ctx.create_compute_pipeline(
+            partial_shader, "main", pipeline_layout, pipeline_cache, nullptr)),
+        final_pipeline(ctx.create_compute_pipeline(
+            final_shader, "main", pipeline_layout, pipeline_cache, nullptr)) {}
+};
+
+// Only created for shaders that read ogler_stats
+struct Ogler::StatsCompute {
+  std::shared_ptr<StatsProgram> program;
+  vk::raii::DescriptorPool descriptor_pool;
+  // One descriptor set per recording of each frame in flight
+  std::vector<vk::raii::DescriptorSet> descriptor_sets;
+
+  static inline vk::raii::DescriptorPool
+  create_descriptor_pool(VulkanContext &ctx, uint32_t num_sets) {
+    std::vector<vk::DescriptorPoolSize> pool_sizes = {
+        // Input textures
+        {
+            .type = vk::DescriptorType::eCombinedImageSampler,
+            .descriptorCount = max_num_inputs * num_sets,
+        },
+        // Partials and Stats
+        {
+            .type = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = num_sets * 2,
+        },
+    };
+
+    vk::DescriptorPoolCreateInfo create_info{
+        .flags = vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
+        .maxSets = num_sets,
+        .poolSizeCount = static_cast<uint32_t>(pool_sizes.size()),
+        .pPoolSizes = pool_sizes.data(),
+    };
+    return ctx.device.createDescriptorPool(create_info);
+  }
+
+  StatsCompute(VulkanContext &ctx, std::shared_ptr<StatsProgram> program,
+               uint32_t num_frames)
+      : program(std::move(program)),
+        descriptor_pool(create_descriptor_pool(ctx, num_frames * 2)),
+        descriptor_sets(Compute::create_descriptor_sets(
+            ctx, descriptor_pool, this->program->descriptor_set_layout,
+            num_frames * 2)) {}
+};
+
+// Result of compiling a video shader source, looked up by the source in
+// SharedVulkan so that every instance running the same shader shares it
+struct SharedShader {
+  // The first instance needing the shader compiles it, the others wait for
+  // it to be done
+  std::once_flag compiled;
+  std::optional<std::string> error;
+  ShaderData shader_data;
+  std::pair<uint32_t, uint32_t> gmem_output_range{};
+  std::unique_ptr<ComputeProgram> program;
+};
+
+// Descriptor sets depend on the number of frames in flight, which can change
+// while compiling, so they are only allocated when installing
+struct Ogler::CompiledShader {
+  uint64_t generation{};
+  std::optional<std::string> error;
+  std::shared_ptr<SharedShader> shader;
+  std::shared_ptr<StatsProgram> stats_program;
 };
-} // namespace ogler
\ No newline at end of file
+} // namespace ogler
@@ -63,7 +63,8 @@ void WriteInt(std::string_view key, int value, std::string_view file) {
 } // namespace
 
 namespace ogler {
-Preferences::Preferences(const char *file) : file(file) {}
+Preferences::Preferences(const char *file, StatisticsFunc statistics)
+    : file(file), statistics(statistics) {}
 
 std::string Preferences::get_font_face() const {
   return ReadString("font_face", "Courier New", file);
@@ -99,12 +100,28 @@ bool Preferences::set_tab_width(int value) {
   return true;
 }
 
+int Preferences::get_frames_in_flight() const {
+  return ReadInt("frames_in_flight", 1, file);
+}
+bool Preferences::set_frames_in_flight(int value) {
+  WriteInt("frames_in_flight", value, file);
+  return true;
+}
+
+std::string Preferences::get_statistics() const {
+  if (!statistics) {
+    return {};
+  }
+  return statistics();
+}
+
 PreferencesWindow::PreferencesWindow(HWND hWnd, HINSTANCE hinstance,
                                      HMENU hMenu, HWND hwndParent, int cy,
                                      int cx, int y, int x, LONG style,
                                      const char *name, const char *cls,
-                                     DWORD exStyle, const char *file)
-    : hwnd(hWnd), file(file) {}
+                                     DWORD exStyle, const char *file,
+                                     StatisticsFunc statistics)
+    : hwnd(hWnd), file(file), statistics(statistics) {}
 
 static int EnumMonospaceFontsCallback(const LOGFONT *lpelfe,
                                       const TEXTMETRIC *lpntme, DWORD FontType,
@@ -129,7 +146,7 @@ void PreferencesWindow::window_created() {
   EnumFontFamiliesEx(hdc, &font, EnumMonospaceFontsCallback,
                      reinterpret_cast<LPARAM>(&monospace_fonts), 0);
 
-  auto prefs = sciter::value::wrap_asset(new Preferences(file));
+  auto prefs = sciter::value::wrap_asset(new Preferences(file, statistics));
   SciterSetVariable(hwnd, "ogler_preferences", &prefs);
 
   std::vector<sciter::value> sciter_values;
@@ -33,11 +33,15 @@
 #include "sciter_window.hpp"
 
 namespace ogler {
+// Returns runtime statistics to display, which only the plugin can gather
+using StatisticsFunc = std::string (*)();
+
 class Preferences : public sciter::om::asset<Preferences> {
   const char *file;
+  StatisticsFunc statistics;
 
 public:
-  Preferences(const char *file);
+  Preferences(const char *file, StatisticsFunc statistics = nullptr);
 
   std::string get_font_face() const;
   bool set_font_face(const std::string &name);
@@ -54,13 +58,20 @@ public:
   int get_tab_width() const;
   bool set_tab_width(int value);
 
+  int get_frames_in_flight() const;
+  bool set_frames_in_flight(int value);
+
+  std::string get_statistics() const;
+
   SOM_PASSPORT_BEGIN_EX(ogler, Preferences)
-  SOM_FUNCS()
+  SOM_FUNCS(SOM_FUNC(get_statistics))
   SOM_PROPS(SOM_VIRTUAL_PROP(font_face, get_font_face, set_font_face),
             SOM_VIRTUAL_PROP(font_size, get_font_size, set_font_size),
             SOM_VIRTUAL_PROP(view_ws, get_view_ws, set_view_ws),
             SOM_VIRTUAL_PROP(use_tabs, get_use_tabs, set_use_tabs),
-            SOM_VIRTUAL_PROP(tab_width, get_tab_width, set_tab_width), )
+            SOM_VIRTUAL_PROP(tab_width, get_tab_width, set_tab_width),
+            SOM_VIRTUAL_PROP(frames_in_flight, get_frames_in_flight,
+                             set_frames_in_flight), )
   SOM_PASSPORT_END
 };
 
@@ -69,6 +80,7 @@ class PreferencesWindow final : public SciterWindow<PreferencesWindow> {
 
   HWND hwnd;
   const char *file;
+  StatisticsFunc statistics;
 
 protected:
   void window_created() override;
@@ -78,7 +90,7 @@ public:
   PreferencesWindow(HWND hWnd, HINSTANCE hinstance, HMENU hMenu,
                     HWND hwndParent, int cy, int cx, int y, int x, LONG style,
                     const char *name, const char *cls, DWORD exStyle,
-                    const char *file);
+                    const char *file, StatisticsFunc statistics = nullptr);
   virtual ~PreferencesWindow();
 };
 } // namespace ogler
\ No newline at end of file
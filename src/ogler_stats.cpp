@@ -0,0 +1,172 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#include "compile_shader.hpp"
+#include "ogler_compute.hpp"
+#include "ogler_uniforms.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <variant>
+
+namespace ogler {
+
+// Both passes run one workgroup per dispatch and channel, the first one
+// stores one partial result per workgroup, the second one combines them
+static constexpr const char *stats_source = R"(
+layout(local_size_x = 256) in;
+
+struct OglerStats {
+  vec4 min_value;
+  vec4 max_value;
+  vec4 mean;
+  uint histogram[OGLER_STATS_BINS];
+};
+
+layout(binding = 0) uniform sampler2D inputs[OGLER_MAX_INPUTS];
+layout(binding = 1) buffer Partials {
+  OglerStats partials[];
+};
+layout(binding = 2) buffer writeonly Stats {
+  OglerStats stats[];
+};
+layout(push_constant) uniform Channel {
+  uint channel;
+};
+
+shared vec4 shared_min[256];
+shared vec4 shared_max[256];
+shared vec4 shared_sum[256];
+shared uint shared_histogram[OGLER_STATS_BINS];
+
+void reduce(uint id, vec4 min_value, vec4 max_value, vec4 sum) {
+  shared_min[id] = min_value;
+  shared_max[id] = max_value;
+  shared_sum[id] = sum;
+  barrier();
+  for (uint stride = 128u; stride > 0u; stride >>= 1) {
+    if (id < stride) {
+      shared_min[id] = min(shared_min[id], shared_min[id + stride]);
+      shared_max[id] = max(shared_max[id], shared_max[id + stride]);
+      shared_sum[id] += shared_sum[id + stride];
+    }
+    barrier();
+  }
+}
+
+#ifndef OGLER_STATS_FINAL
+void main() {
+  uint id = gl_LocalInvocationIndex;
+  if (id < OGLER_STATS_BINS) {
+    shared_histogram[id] = 0u;
+  }
+  barrier();
+
+  // Pixel values are normalized, so these are the neutral elements
+  vec4 min_value = vec4(1.0);
+  vec4 max_value = vec4(0.0);
+  vec4 sum = vec4(0.0);
+  ivec2 size = textureSize(inputs[channel], 0);
+  uint width = uint(size.x);
+  uint num_pixels = width * uint(size.y);
+  for (uint i = gl_GlobalInvocationID.x; i < num_pixels;
+       i += uint(OGLER_STATS_GROUPS * 256)) {
+    vec4 color = texelFetch(inputs[channel], ivec2(i % width, i / width), 0);
+    min_value = min(min_value, color);
+    max_value = max(max_value, color);
+    sum += color;
+    float luma = dot(color.rgb, vec3(0.2126, 0.7152, 0.0722));
+    uint bin = min(uint(luma * OGLER_STATS_BINS), uint(OGLER_STATS_BINS - 1));
+    atomicAdd(shared_histogram[bin], 1u);
+  }
+  reduce(id, min_value, max_value, sum);
+
+  uint index = channel * OGLER_STATS_GROUPS + gl_WorkGroupID.x;
+  if (id == 0) {
+    partials[index].min_value = shared_min[0];
+    partials[index].max_value = shared_max[0];
+    partials[index].mean = shared_sum[0];
+  }
+  if (id < OGLER_STATS_BINS) {
+    partials[index].histogram[id] = shared_histogram[id];
+  }
+}
+#else
+void main() {
+  uint id = gl_LocalInvocationIndex;
+  uint first = channel * OGLER_STATS_GROUPS;
+  vec4 min_value = vec4(1.0);
+  vec4 max_value = vec4(0.0);
+  vec4 sum = vec4(0.0);
+  if (id < OGLER_STATS_GROUPS) {
+    min_value = partials[first + id].min_value;
+    max_value = partials[first + id].max_value;
+    sum = partials[first + id].mean;
+  }
+  reduce(id, min_value, max_value, sum);
+
+  if (id < OGLER_STATS_BINS) {
+    uint count = 0u;
+    for (uint i = 0; i < OGLER_STATS_GROUPS; ++i) {
+      count += partials[first + i].histogram[id];
+    }
+    stats[channel].histogram[id] = count;
+  }
+  if (id == 0) {
+    ivec2 size = textureSize(inputs[channel], 0);
+    stats[channel].min_value = shared_min[0];
+    stats[channel].max_value = shared_max[0];
+    stats[channel].mean = shared_sum[0] / max(float(size.x * size.y), 1.0);
+  }
+}
+#endif
+)";
+
+static std::vector<unsigned> compile_stats_shader(bool final_pass) {
+  std::string defines = "#version 460\n";
+  defines += "#define OGLER_MAX_INPUTS " + std::to_string(max_num_inputs) + "\n";
+  defines +=
+      "#define OGLER_STATS_GROUPS " + std::to_string(stats_num_groups) + "\n";
+  defines +=
+      "#define OGLER_STATS_BINS " + std::to_string(stats_histogram_bins) + "\n";
+  if (final_pass) {
+    defines += "#define OGLER_STATS_FINAL\n";
+  }
+
+  auto res = compile_shader({{"<stats>", defines}, {"<stats>", stats_source}},
+                            /*params_binding=*/-1);
+  if (std::holds_alternative<std::string>(res)) {
+    throw std::runtime_error(std::get<std::string>(res));
+  }
+  return std::move(std::get<ShaderData>(res).spirv_code);
+}
+
+const std::vector<unsigned> &stats_shader_code(bool final_pass) {
+  static const std::vector<unsigned> partial_code = compile_stats_shader(false);
+  static const std::vector<unsigned> final_code = compile_stats_shader(true);
+  return final_pass ? final_code : partial_code;
+}
+} // namespace ogler
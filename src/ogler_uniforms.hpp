@@ -30,10 +30,11 @@
 
 #include <WDL/eel2/ns-eel.h>
 
-#include <vulkan/vulkan.hpp>
+#include "vulkan_context.hpp"
 
 namespace ogler {
 
+// Matches the std140 layout of UniformBlock in the shader preamble
 struct Uniforms {
   float iResolution_w, iResolution_h;
   float iTime;
@@ -42,19 +43,31 @@ struct Uniforms {
   float iWet;
   int num_inputs;
 };
-static_assert(sizeof(Uniforms) < 128,
-              "Keep this under 128 bytes to ensure compatibility!");
-
-union UniformsView {
-  Uniforms data;
-  std::array<float, sizeof(data) / sizeof(float)> values;
-};
 
 static constexpr unsigned max_num_inputs = 64;
 
 static constexpr uint32_t gmem_size =
     NSEEL_RAM_BLOCKS * NSEEL_RAM_ITEMSPERBLOCK;
 
+// Bit pattern the gmem output window is filled with before each frame. It is
+// a NaN that ogler_gmem_write() never stores, so elements still holding it
+// were not written by the shader.
+static constexpr uint32_t gmem_output_unwritten = 0x7FC0DEADu;
+
+// Workgroups each input is split into by the first statistics pass
+static constexpr uint32_t stats_num_groups = 32;
+// Also hardcoded in OglerStats in the shader preamble
+static constexpr uint32_t stats_histogram_bins = 64;
+
+// Matches the std430 layout of OglerStats in the shader preamble. The first
+// statistics pass stores the sum of the pixels in mean.
+struct ChannelStats {
+  std::array<float, 4> min_value;
+  std::array<float, 4> max_value;
+  std::array<float, 4> mean;
+  std::array<uint32_t, stats_histogram_bins> histogram;
+};
+
 static constexpr vk::Format RGBAFormat = vk::Format::eB8G8R8A8Unorm;
 
 } // namespace ogler
\ No newline at end of file
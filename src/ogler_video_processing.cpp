@@ -26,9 +26,15 @@
 
 #include "ogler_compute.hpp"
 #include "ogler_uniforms.hpp"
+#include "pixel_copy.hpp"
 #include "video_frame.h"
 
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <span>
+#include <utility>
 #include <vulkan/vulkan_raii.hpp>
 
 namespace ogler {
@@ -100,30 +106,82 @@ static void transition_image_layout_download(vk::raii::CommandBuffer &cmd,
   cmd.pipelineBarrier(sourceStage, destinationStage, {}, {}, {}, {barrier});
 }
 
-InputImage Ogler::create_input_image(int w, int h) {
-  auto img = shared.vulkan.create_image(
-      w, h, RGBAFormat, vk::ImageTiling::eOptimal,
-      vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled);
-  auto buf = shared.vulkan.create_buffer<char>(
-      {}, w * h * 4, vk::BufferUsageFlagBits::eTransferSrc,
+std::optional<Buffer<float>> Ogler::create_params_buffer() {
+  if (data.parameters.empty()) {
+    return std::nullopt;
+  }
+  return shared.vulkan.create_buffer<float>(
+      {}, data.parameters.size(), vk::BufferUsageFlagBits::eUniformBuffer,
       vk::SharingMode::eExclusive,
-      vk::MemoryPropertyFlagBits::eHostVisible |
-          vk::MemoryPropertyFlagBits::eHostCoherent);
-  auto view = shared.vulkan.create_image_view(img, RGBAFormat);
+      vk::MemoryPropertyFlagBits::eHostCoherent |
+          vk::MemoryPropertyFlagBits::eHostVisible);
+}
 
+// Frames can be recreated after the shader is installed, so they get their
+// parameters buffer here rather than only from install_shaders()
+FrameResources Ogler::create_frame_resources() {
   return {
-      .image = std::move(img),
-      .transfer_buffer = std::move(buf),
-      .view = std::move(view),
+      .recordings =
+          {
+              RecordedFrame{
+                  .command_buffer = shared.vulkan.create_command_buffer(),
+              },
+              RecordedFrame{
+                  .command_buffer = shared.vulkan.create_command_buffer(),
+              },
+          },
+      .fence = shared.vulkan.create_fence(),
+      .setup_command_buffer = shared.vulkan.create_command_buffer(),
+      .readback_command_buffer = shared.vulkan.create_command_buffer(),
+      .params_buffer = create_params_buffer(),
+      .input_resolution_buffer =
+          shared.vulkan.create_buffer<std::pair<float, float>>(
+              {}, max_num_inputs, vk::BufferUsageFlagBits::eUniformBuffer,
+              vk::SharingMode::eExclusive,
+              vk::MemoryPropertyFlagBits::eHostCoherent |
+                  vk::MemoryPropertyFlagBits::eHostVisible),
+      .uniforms_buffer = shared.vulkan.create_buffer<Uniforms>(
+          {}, 1, vk::BufferUsageFlagBits::eUniformBuffer,
+          vk::SharingMode::eExclusive,
+          vk::MemoryPropertyFlagBits::eHostCoherent |
+              vk::MemoryPropertyFlagBits::eHostVisible),
   };
 }
 
+void Ogler::set_frames_in_flight(int num_frames) {
+  num_frames = std::clamp(num_frames, 1, max_frames_in_flight);
+  if (frames.size() == static_cast<size_t>(num_frames)) {
+    return;
+  }
+
+  drain_frames();
+  // Descriptor sets are allocated for each frame, the programs stay the same
+  if (compute) {
+    compute = std::make_unique<Compute>(shared.vulkan, compute->program,
+                                        num_frames);
+  }
+  if (stats_compute) {
+    stats_compute = std::make_unique<StatsCompute>(
+        shared.vulkan, stats_compute->program, num_frames);
+  }
+  frames.clear();
+  for (int i = 0; i < num_frames; ++i) {
+    frames.push_back(create_frame_resources());
+  }
+  next_frame = 0;
+  latency_frames = frames.size() - 1;
+}
+
 bool Ogler::init() {
   eel_mutex = reaper->get_eel_mutex();
 
   one_shot_execute([&]() {
-    transition_image_layout_download(command_buffer, output_image);
-    transition_image_layout_download(command_buffer, previous_image);
+    transition_image_layout_upload(command_buffer, empty_input.image,
+                                   vk::ImageLayout::eUndefined,
+                                   vk::ImageLayout::eTransferDstOptimal);
+    transition_image_layout_upload(command_buffer, empty_input.image,
+                                   vk::ImageLayout::eTransferDstOptimal,
+                                   vk::ImageLayout::eShaderReadOnlyOptimal);
   });
 
   gmem = reaper->eel_gmem_attach();
@@ -138,32 +196,27 @@ void Ogler::update_frame_buffers() noexcept {
   auto new_width = get_output_width();
   auto new_height = get_output_height();
 
+  if (frames.empty()) {
+    return;
+  }
+
   if (new_width != old_width || new_height != old_height) {
-    output_transfer_buffer = shared.vulkan.create_buffer<char>(
-        {}, new_width * new_height * 4, vk::BufferUsageFlagBits::eTransferDst,
-        vk::SharingMode::eExclusive,
-        vk::MemoryPropertyFlagBits::eHostVisible |
-            vk::MemoryPropertyFlagBits::eHostCoherent);
-    output_image = shared.vulkan.create_image(
-        new_width, new_height, RGBAFormat, vk::ImageTiling::eOptimal,
-        vk::ImageUsageFlagBits::eStorage |
-            vk::ImageUsageFlagBits::eTransferSrc |
-            vk::ImageUsageFlagBits::eSampled);
-    output_image_view =
-        shared.vulkan.create_image_view(output_image, RGBAFormat);
-
-    previous_image = shared.vulkan.create_image(
-        new_width, new_height, RGBAFormat, vk::ImageTiling::eOptimal,
-        vk::ImageUsageFlagBits::eStorage |
-            vk::ImageUsageFlagBits::eTransferSrc |
-            vk::ImageUsageFlagBits::eSampled);
-    previous_image_view =
-        shared.vulkan.create_image_view(previous_image, RGBAFormat);
-
-    one_shot_execute([&]() {
-      transition_image_layout_download(command_buffer, output_image);
-      transition_image_layout_download(command_buffer, previous_image);
-    });
+    invalidate_recordings();
+
+    // Frames in flight are still using the old images. They complete in
+    // submission order, so the images can be reused once the last one does.
+    auto &last_frame = frames[(next_frame + frames.size() - 1) % frames.size()];
+    if (last_frame.pending) {
+      last_frame.retired_outputs.push_back(std::move(output_image));
+      last_frame.retired_outputs.push_back(std::move(previous_image));
+    } else {
+      shared.release_output_image(std::move(output_image));
+      shared.release_output_image(std::move(previous_image));
+    }
+
+    // Layout transitions, if needed, are submitted with the next frame
+    output_image = shared.acquire_output_image(new_width, new_height);
+    previous_image = shared.acquire_output_image(new_width, new_height);
   }
 }
 
@@ -172,283 +225,452 @@ static std::span<char> get_frame_bits(IVideoFrame *frame) {
                          frame->get_rowspan() * frame->get_h());
 }
 
-template <size_t pixel_size = 4>
-static void copy_image(std::span<char> src_span, std::span<char> dst_span,
-                       size_t w, size_t h, size_t src_stride,
-                       size_t dst_stride) {
-  char *src = src_span.data();
-  char *dst = dst_span.data();
-  for (size_t i = 0; i < h; ++i) {
-    std::memcpy(dst, src, w * pixel_size);
-    src += src_stride;
-    dst += dst_stride;
+// Frame copies are bound by memory bandwidth, splitting them any finer costs
+// more in synchronization than it gains
+static constexpr size_t min_copy_chunk_bytes = 256 * 1024;
+
+template <typename Copy>
+static void parallel_copy_pixels(WorkerPool &workers, Copy copy,
+                                 const char *src, char *dst, size_t w,
+                                 size_t h, size_t src_stride,
+                                 size_t dst_stride,
+                                 unsigned flags = pixel_copy_plain) {
+  auto min_rows = std::max<size_t>(min_copy_chunk_bytes / (w * 4 + 1), 1);
+  workers.parallel_for(h, min_rows, [&](size_t begin, size_t end) {
+    copy(src + begin * src_stride, dst + begin * dst_stride, w, end - begin,
+         src_stride, dst_stride, flags);
+  });
+}
+
+// Row stride to use for the transfer buffer of a frame: REAPER's own if
+// Vulkan can describe it, since bufferRowLength is expressed in pixels
+static int transfer_stride(IVideoFrame *frame) {
+  auto rowspan = frame->get_rowspan();
+  auto packed = frame->get_w() * 4;
+  if (rowspan % 4 != 0 || rowspan < packed) {
+    return packed;
   }
+  return rowspan;
 }
 
-IVideoFrame *Ogler::video_process_frame(std::span<const double> parms,
-                                        double project_time, double framerate,
-                                        FrameFormat force_format) noexcept {
-  std::unique_lock<std::mutex> lock(video_mutex, std::try_to_lock_t{});
-  if (!lock.owns_lock()) {
-    return nullptr;
+// Importing allocates device memory and pins the pages, which for small
+// frames costs more than copying them
+static constexpr size_t min_import_bytes = 1024 * 1024;
+
+std::optional<FrameBufferRegion> Ogler::import_frame(FrameResources &resources,
+                                                     IVideoFrame *frame) {
+  auto rowspan = frame->get_rowspan();
+  if (transfer_stride(frame) != rowspan) {
+    return std::nullopt;
+  }
+  auto bits = get_frame_bits(frame);
+  if (bits.size() < min_import_bytes ||
+      reinterpret_cast<uintptr_t>(bits.data()) % 4 != 0) {
+    return std::nullopt;
   }
 
-  if (!compute) {
-    return nullptr;
+  // Several channels can be given the same frame
+  auto it = std::find_if(resources.imported_frames.begin(),
+                         resources.imported_frames.end(),
+                         [&](const ImportedFrame &imported) {
+                           return imported.bits == bits.data() &&
+                                  imported.size == bits.size();
+                         });
+  if (it == resources.imported_frames.end()) {
+    auto buffer = shared.vulkan.import_host_memory(
+        bits.data(), bits.size(),
+        vk::BufferUsageFlagBits::eTransferSrc |
+            vk::BufferUsageFlagBits::eTransferDst);
+    if (!buffer) {
+      return std::nullopt;
+    }
+    resources.imported_frames.push_back({
+        .bits = bits.data(),
+        .size = bits.size(),
+        .buffer = std::move(*buffer),
+    });
+    it = std::prev(resources.imported_frames.end());
   }
+  return FrameBufferRegion{
+      .buffer = *it->buffer.buffer,
+      .offset = it->buffer.offset,
+      .row_length = static_cast<uint32_t>(rowspan / 4),
+      .imported = true,
+  };
+}
 
-  update_frame_buffers();
+static void record_input_upload(vk::raii::CommandBuffer &command_buffer,
+                                const FrameInput &input) {
+  auto &image = input.image->image;
+  transition_image_layout_upload(command_buffer, image,
+                                 vk::ImageLayout::eUndefined,
+                                 vk::ImageLayout::eTransferDstOptimal);
 
-  output_frame = vproc->newVideoFrame(output_image.width, output_image.height,
-                                      (int)FrameFormat::RGBA);
-  auto output_rowspan = output_frame->get_rowspan();
-  auto output_w = output_frame->get_w();
-  auto output_h = output_frame->get_h();
-  auto num_inputs = vproc->getNumInputs();
+  vk::BufferImageCopy region{
+      .bufferOffset = input.source.offset,
+      .bufferRowLength = input.source.row_length,
+      .bufferImageHeight = 0,
+      .imageSubresource =
+          {
+              .aspectMask = vk::ImageAspectFlagBits::eColor,
+              .layerCount = 1,
+          },
+      .imageExtent =
+          {
+              .width = static_cast<uint32_t>(image.width),
+              .height = static_cast<uint32_t>(image.height),
+              .depth = 1,
+          },
+  };
+  command_buffer.copyBufferToImage(input.source.buffer, *image.image,
+                                   vk::ImageLayout::eTransferDstOptimal,
+                                   {region});
+
+  transition_image_layout_upload(command_buffer, image,
+                                 vk::ImageLayout::eTransferDstOptimal,
+                                 vk::ImageLayout::eShaderReadOnlyOptimal);
+}
 
-  UniformsView uniforms{
-      .data =
+// The image must have been made available to transfers already
+static void record_output_download(vk::raii::CommandBuffer &command_buffer,
+                                   const OutputImage &image,
+                                   const FrameBufferRegion &output) {
+  vk::BufferImageCopy region{
+      .bufferOffset = output.offset,
+      .bufferRowLength = output.row_length,
+      .imageSubresource =
+          {
+              .aspectMask = vk::ImageAspectFlagBits::eColor,
+              .layerCount = 1,
+          },
+      .imageExtent =
           {
-              .iResolution_w = static_cast<float>(output_image.width),
-              .iResolution_h = static_cast<float>(output_image.height),
-              .iTime = static_cast<float>(project_time),
-              .iSampleRate = 0,
-              .iFrameRate = static_cast<float>(framerate),
-              .iWet = static_cast<float>(parms[0]),
-              .num_inputs =
-                  std::min({static_cast<int>(max_num_inputs), num_inputs}),
+              .width = static_cast<uint32_t>(image.width),
+              .height = static_cast<uint32_t>(image.height),
+              .depth = 1,
           },
   };
+  command_buffer.copyImageToBuffer(*image.image, vk::ImageLayout::eGeneral,
+                                   output.buffer, {region});
+
+  vk::BufferMemoryBarrier buf_mem_barrier{
+      .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+      .dstAccessMask = vk::AccessFlagBits::eHostRead,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .buffer = output.buffer,
+      .size = VK_WHOLE_SIZE,
+  };
+  command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                 vk::PipelineStageFlagBits::eHost, {}, {},
+                                 {buf_mem_barrier}, {});
+}
 
-  {
-    vk::CommandBufferBeginInfo begin_info{
-        .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit,
-    };
-    command_buffer.begin(begin_info);
+IVideoFrame *Ogler::retire_frame(FrameResources &frame) {
+  auto res = shared.vulkan.device.waitForFences({*frame.fence}, // List of fences
+                                                true,           // Wait All
+                                                uint64_t(-1));  // Timeout
+  assert(res == vk::Result::eSuccess);
+
+  auto output_frame = std::exchange(frame.output_frame, nullptr);
+  if (!frame.output_imported) {
+    frame.output_transfer_buffer->memory.invalidate();
+    auto output_bits = get_frame_bits(output_frame);
+    parallel_copy_pixels(shared.workers, readback_pixels,
+                         frame.output_transfer_buffer->map.data(),
+                         output_bits.data(), output_frame->get_w(),
+                         output_frame->get_h(), transfer_stride(output_frame),
+                         output_frame->get_rowspan());
   }
 
-  {
-    std::unique_lock<EELMutex> eel_lock(*eel_mutex);
-    auto dst = shared.gmem_transfer_buffer.map.data();
-    double **pblocks = *gmem;
-    if (pblocks) {
-      for (size_t i = 0; i < NSEEL_RAM_BLOCKS; ++i) {
-        auto buf = pblocks[i];
-        if (buf) {
-          for (size_t j = 0; j < NSEEL_RAM_ITEMSPERBLOCK; ++j) {
-            dst[i * NSEEL_RAM_ITEMSPERBLOCK + j] = buf[j];
-          }
-
-          command_buffer.copyBuffer(
-              *shared.gmem_transfer_buffer.buffer, *shared.gmem_buffer.buffer,
-              {
-                  {
-                      .srcOffset = i * sizeof(float) * NSEEL_RAM_ITEMSPERBLOCK,
-                      .dstOffset = i * sizeof(float) * NSEEL_RAM_ITEMSPERBLOCK,
-                      .size = sizeof(float) * NSEEL_RAM_ITEMSPERBLOCK,
-                  },
-              });
-        }
-      }
+  read_back_gmem_output(frame);
 
-      command_buffer.pipelineBarrier(
-          vk::PipelineStageFlagBits::eHost,
-          vk::PipelineStageFlagBits::eComputeShader, {}, {},
-          {
-              vk::BufferMemoryBarrier{
-                  .srcAccessMask = vk::AccessFlagBits::eHostWrite,
-                  .dstAccessMask = vk::AccessFlagBits::eShaderRead,
-                  .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-                  .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-                  .buffer = *shared.gmem_buffer.buffer,
-                  .size = VK_WHOLE_SIZE,
-              },
-          },
-          {});
-    }
+  release_frame_resources(frame);
+
+  return output_frame;
+}
+
+void Ogler::release_frame_resources(FrameResources &frame) {
+  shared.vulkan.device.resetFences({*frame.fence});
+  frame.imported_frames.clear();
+  frame.output_imported = false;
+  frame.gmem_buffer = nullptr;
+  for (auto &image : frame.retired_outputs) {
+    shared.release_output_image(std::move(image));
   }
+  frame.retired_outputs.clear();
+  frame.pending = false;
+}
 
-  transition_image_layout_upload(command_buffer, empty_input.image,
-                                 vk::ImageLayout::eUndefined,
-                                 vk::ImageLayout::eTransferDstOptimal);
-  transition_image_layout_upload(command_buffer, empty_input.image,
-                                 vk::ImageLayout::eTransferDstOptimal,
-                                 vk::ImageLayout::eShaderReadOnlyOptimal);
+// Even with a single frame in flight, where the frame is retired right after
+// waiting for it in the same video_process_frame call, the values only reach
+// gmem in the next call: JSFX see them with the same delay either way, and
+// the wait is not followed by contending for the EEL lock.
+void Ogler::read_back_gmem_output(FrameResources &frame) {
+  // Two frames can be retired in the same call, the older values are not lost
+  write_back_gmem();
+
+  auto [begin, count] = frame.gmem_output_range;
+  if (count == 0) {
+    return;
+  }
 
-  std::array<std::pair<float, float>, max_num_inputs> input_resolution;
-  std::array<vk::DescriptorImageInfo, max_num_inputs> input_image_info;
-  size_t n_inputs = 0;
-  for (size_t i = 0; i < max_num_inputs; ++i) {
-    auto input_frame = vproc->renderInputVideoFrame(i, (int)FrameFormat::RGBA);
-    if (!input_frame) {
-      input_resolution[i] = {1.f, 1.f};
-      input_image_info[i] = {
-          .sampler = *sampler,
-          .imageView = *empty_input.view,
-          .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
-      };
+  // Converted before taking the lock, so that JSFX are held up only for the
+  // copy itself
+  gmem_output_begin = begin;
+  frame.gmem_output_buffer->memory.invalidate();
+  auto values = frame.gmem_output_buffer->map.data();
+  gmem_output_values.assign(values, values + count);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t bits;
+    std::memcpy(&bits, values + i, sizeof(bits));
+    if (bits == gmem_output_unwritten) {
+      continue;
+    }
+    if (!gmem_output_written.empty() &&
+        gmem_output_written.back().second == i) {
+      ++gmem_output_written.back().second;
     } else {
-      auto input_w = input_frame->get_w();
-      auto input_h = input_frame->get_h();
-      auto input_rowspan = input_frame->get_rowspan();
-      auto input_bits = get_frame_bits(input_frame);
+      gmem_output_written.emplace_back(i, i + 1);
+    }
+  }
+}
+
+void Ogler::write_back_gmem() {
+  if (gmem_output_written.empty()) {
+    return;
+  }
 
-      if (n_inputs >= input_images.size()) {
-        input_images.push_back(create_input_image(input_w, input_h));
+  auto begin = gmem_output_begin;
+  std::unique_lock<EELMutex> eel_lock(*eel_mutex);
+  double **blocks = *gmem;
+  if (!blocks) {
+    gmem_output_written.clear();
+    return;
+  }
+  for (auto [written_first, written_last] : gmem_output_written) {
+    auto end = begin + written_last;
+    for (auto first = begin + written_first; first < end;) {
+      auto block = first / NSEEL_RAM_ITEMSPERBLOCK;
+      auto last = std::min((block + 1) * NSEEL_RAM_ITEMSPERBLOCK, end);
+      // Blocks are only allocated by JSFX, the ones nobody uses are skipped
+      if (blocks[block]) {
+        std::memcpy(blocks[block] + first % NSEEL_RAM_ITEMSPERBLOCK,
+                    gmem_output_values.data() + (first - begin),
+                    (last - first) * sizeof(double));
       }
+      first = last;
+    }
+  }
+  gmem_output_written.clear();
+}
+
+void Ogler::drain_frames() {
+  for (auto &frame : frames) {
+    if (!frame.pending) {
+      continue;
+    }
 
-      auto &input_image = input_images[n_inputs];
-      ++n_inputs;
+    auto res = shared.vulkan.device.waitForFences({*frame.fence}, true,
+                                                  uint64_t(-1));
+    assert(res == vk::Result::eSuccess);
+    release_frame_resources(frame);
 
-      if (input_image.image.width != input_w ||
-          input_image.image.height != input_h) {
-        input_image = create_input_image(input_w, input_h);
-      }
+    std::exchange(frame.output_frame, nullptr)->Release();
+  }
+  next_frame = 0;
+}
 
-      input_resolution[i] = {static_cast<float>(input_w),
-                             static_cast<float>(input_h)};
+void Ogler::invalidate_recordings() {
+  for (auto &frame : frames) {
+    frame.invalidate();
+  }
+}
+
+void Ogler::record_frame(
+    FrameResources &frame, RecordedFrame &recording, size_t descriptor_set,
+    const SharedVulkan::GmemBindings &gmem_bindings,
+    const std::array<FrameInput, max_num_inputs> &inputs,
+    const FrameBufferRegion &output) {
+  auto &command_buffer = recording.command_buffer;
+
+  {
+    std::array<vk::DescriptorImageInfo, max_num_inputs> input_image_info;
+    for (size_t i = 0; i < max_num_inputs; ++i) {
       input_image_info[i] = {
           .sampler = *sampler,
-          .imageView = *input_image.view,
+          .imageView =
+              inputs[i].image ? *inputs[i].image->view : *empty_input.view,
           .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
       };
-
-      copy_image(input_bits, input_image.transfer_buffer.map, input_w, input_h,
-                 input_rowspan, input_w * 4);
-
-      {
-        transition_image_layout_upload(command_buffer, input_image.image,
-                                       vk::ImageLayout::eUndefined,
-                                       vk::ImageLayout::eTransferDstOptimal);
-
-        vk::BufferImageCopy region{
-            .bufferOffset = 0,
-            .bufferRowLength = 0,
-            .bufferImageHeight = 0,
-            .imageSubresource =
-                {
-                    .aspectMask = vk::ImageAspectFlagBits::eColor,
-                    .layerCount = 1,
-                },
-            .imageExtent =
-                {
-                    .width = static_cast<uint32_t>(input_w),
-                    .height = static_cast<uint32_t>(input_h),
-                    .depth = 1,
-                },
-        };
-        command_buffer.copyBufferToImage(
-            *input_image.transfer_buffer.buffer, *input_image.image.image,
-            vk::ImageLayout::eTransferDstOptimal, {region});
-
-        transition_image_layout_upload(command_buffer, input_image.image,
-                                       vk::ImageLayout::eTransferDstOptimal,
-                                       vk::ImageLayout::eShaderReadOnlyOptimal);
-      }
     }
-  }
-
-  {
-    vk::DescriptorImageInfo output_image_info{
-        .sampler = *sampler,
-        .imageView = *output_image_view,
-        .imageLayout = vk::ImageLayout::eGeneral,
-    };
-    vk::DescriptorBufferInfo gmem_buffer_info{
-        .buffer = *shared.gmem_buffer.buffer,
-        .offset = 0,
-        .range = gmem_size * sizeof(float),
-    };
-    vk::DescriptorBufferInfo input_resolution_info{
-        .buffer = *input_resolution_buffer.buffer,
+    vk::DescriptorBufferInfo gmem_output_info{
+        .buffer = *frame.gmem_output_buffer->buffer,
         .offset = 0,
-        .range = sizeof(input_resolution),
-    };
-    vk::DescriptorImageInfo previous_frame_info{
-        .sampler = *sampler,
-        .imageView = *previous_image_view,
-        .imageLayout = vk::ImageLayout::eGeneral,
+        .range = VK_WHOLE_SIZE,
     };
 
-    std ::vector<vk::WriteDescriptorSet> write_descriptor_sets = {
-        // Input texture
-        {
-            .dstSet = *compute->descriptor_set,
-            .dstBinding = 1,
-            .descriptorCount = max_num_inputs,
-            .descriptorType = vk::DescriptorType::eCombinedImageSampler,
-            .pImageInfo = input_image_info.data(),
-        },
-        // Output texture
-        {
-            .dstSet = *compute->descriptor_set,
-            .dstBinding = 2,
-            .descriptorCount = 1,
-            .descriptorType = vk::DescriptorType::eStorageImage,
-            .pImageInfo = &output_image_info,
-        },
-        // gmem
-        {
-            .dstSet = *compute->descriptor_set,
-            .dstBinding = 3,
-            .descriptorCount = 1,
-            .descriptorType = vk::DescriptorType::eStorageBuffer,
-            .pBufferInfo = &gmem_buffer_info,
-        },
-        // iChannelResolution[]
-        {
-            .dstSet = *compute->descriptor_set,
-            .dstBinding = 4,
-            .descriptorCount = 1,
-            .descriptorType = vk::DescriptorType::eUniformBuffer,
-            .pBufferInfo = &input_resolution_info,
-        },
-        // ogler_previous_frame
-        {
-            .dstSet = *compute->descriptor_set,
-            .dstBinding = 5,
-            .descriptorCount = 1,
-            .descriptorType = vk::DescriptorType::eCombinedImageSampler,
-            .pImageInfo = &previous_frame_info,
-        },
+    // Every binding is written by the template, those the shader cannot use
+    // point to buffers that always exist
+    ComputeDescriptors descriptors{
+        .params =
+            {
+                .buffer = *frame.uniforms_buffer.buffer,
+                .offset = 0,
+                .range = sizeof(Uniforms),
+            },
+        .channels = input_image_info,
+        .output =
+            {
+                .sampler = *sampler,
+                .imageView = *output_image.view,
+                .imageLayout = vk::ImageLayout::eGeneral,
+            },
+        .input_sizes =
+            {
+                .buffer = *frame.input_resolution_buffer.buffer,
+                .offset = 0,
+                .range = sizeof(std::pair<float, float>) * max_num_inputs,
+            },
+        .previous_frame =
+            {
+                .sampler = *sampler,
+                .imageView = *previous_image.view,
+                .imageLayout = vk::ImageLayout::eGeneral,
+            },
+        .uniforms =
+            {
+                .buffer = *frame.uniforms_buffer.buffer,
+                .offset = 0,
+                .range = sizeof(Uniforms),
+            },
+        .gmem_data =
+            {
+                .buffer = *gmem_bindings.buffer->buffer,
+                .offset = 0,
+                .range = VK_WHOLE_SIZE,
+            },
+        .gmem_blocks =
+            {
+                .buffer = gmem_bindings.block_table,
+                .offset = 0,
+                .range = VK_WHOLE_SIZE,
+            },
+        .gmem_output = gmem_output_info,
+        .stats = gmem_output_info,
     };
+    if (frame.params_buffer && !data.parameters.empty()) {
+      descriptors.params = {
+          .buffer = *frame.params_buffer->buffer,
+          .offset = 0,
+          .range = sizeof(float) * data.parameters.size(),
+      };
+    }
+    if (stats_compute) {
+      descriptors.stats = {
+          .buffer = *frame.stats_buffer->buffer,
+          .offset = 0,
+          .range = VK_WHOLE_SIZE,
+      };
+    }
 
-    std::copy(input_resolution.begin(), input_resolution.end(),
-              input_resolution_buffer.map.begin());
+    // Recordings are redone whenever anything in their key changes, which
+    // often leaves the bound resources as they were. The previous key tells
+    // whether those handles still refer to the same objects.
+    bool descriptors_current =
+        recording.key &&
+        recording.key->gmem_generation == gmem_bindings.generation;
+
+    if (!descriptors_current || recording.descriptors != descriptors) {
+      compute->descriptor_sets[descriptor_set].updateWithTemplate(
+          *compute->program->descriptor_template, descriptors);
+      recording.descriptors = descriptors;
+    }
 
-    vk::DescriptorBufferInfo uniforms_info{
-        .range = sizeof(float) * data.parameters.size(),
-    };
-    if (params_buffer && !data.parameters.empty()) {
-      uniforms_info.buffer = *params_buffer->buffer;
-      // keeping in mind parms[0] is iWet
-      for (size_t i = 0; i < parms.size() - 1; ++i) {
-        params_buffer->map[i] = parms[i + 1];
+    if (stats_compute) {
+      StatsDescriptors stats_descriptors{
+          .channels = input_image_info,
+          .partials =
+              {
+                  .buffer = *frame.stats_partials_buffer->buffer,
+                  .offset = 0,
+                  .range = VK_WHOLE_SIZE,
+              },
+          .stats = descriptors.stats,
+      };
+      if (!descriptors_current ||
+          recording.stats_descriptors != stats_descriptors) {
+        stats_compute->descriptor_sets[descriptor_set].updateWithTemplate(
+            *stats_compute->program->descriptor_template, stats_descriptors);
+        recording.stats_descriptors = stats_descriptors;
       }
-      write_descriptor_sets.push_back({
-          .dstSet = *compute->descriptor_set,
-          .dstBinding = 0,
-          .descriptorCount = 1,
-          .descriptorType = vk::DescriptorType::eUniformBuffer,
-          .pBufferInfo = &uniforms_info,
-      });
     }
+  }
+
+  command_buffer.begin(vk::CommandBufferBeginInfo{});
 
-    shared.vulkan.device.updateDescriptorSets(write_descriptor_sets, {});
+  for (auto &input : inputs) {
+    if (input.image && !input.source.imported) {
+      record_input_upload(command_buffer, input);
+    }
+  }
+
+  if (stats_compute) {
+    record_stats(command_buffer, descriptor_set, inputs);
+  }
+
+  // Parts of the window the shader does not write are left alone in gmem
+  command_buffer.fillBuffer(*frame.gmem_output_buffer->buffer, 0, VK_WHOLE_SIZE,
+                            gmem_output_unwritten);
+
+  {
+    // The previous frame might still be writing to the image we are going to
+    // sample as ogler_previous_frame, or reading from the one we are going to
+    // write to. Also make the gmem upload visible to the shader.
+    vk::MemoryBarrier mem_barrier{
+        .srcAccessMask = vk::AccessFlagBits::eShaderWrite |
+                         vk::AccessFlagBits::eTransferWrite,
+        .dstAccessMask =
+            vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+    };
+    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader |
+                                       vk::PipelineStageFlagBits::eTransfer,
+                                   vk::PipelineStageFlagBits::eComputeShader,
+                                   {}, {mem_barrier}, {}, {});
   }
 
   command_buffer.bindPipeline(vk::PipelineBindPoint::eCompute,
-                              *compute->pipeline);
+                              *compute->program->pipeline);
   command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
-                                    *compute->pipeline_layout, 0,
-                                    {*compute->descriptor_set}, {});
-  command_buffer.pushConstants<float>(*compute->pipeline_layout,
-                                      vk::ShaderStageFlagBits::eCompute, 0,
-                                      uniforms.values);
-  command_buffer.dispatch(output_image.width, output_image.height, 1);
+                                    *compute->program->pipeline_layout, 0,
+                                    {*compute->descriptor_sets[descriptor_set]},
+                                    {});
+  {
+    auto tile = shared.tile_size;
+    auto groups_x =
+        (static_cast<uint32_t>(output_image.width) + tile.width - 1) /
+        tile.width;
+    auto groups_y =
+        (static_cast<uint32_t>(output_image.height) + tile.height - 1) /
+        tile.height;
+    command_buffer.dispatch(groups_x, groups_y, 1);
+  }
+  {
+    vk::BufferMemoryBarrier buf_mem_barrier{
+        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+        .dstAccessMask = vk::AccessFlagBits::eHostRead,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = *frame.gmem_output_buffer->buffer,
+        .size = VK_WHOLE_SIZE,
+    };
+    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                                   vk::PipelineStageFlagBits::eHost, {}, {},
+                                   {buf_mem_barrier}, {});
+  }
   {
     vk::ImageMemoryBarrier img_mem_barrier{
-        .srcAccessMask = vk::AccessFlagBits::eMemoryWrite,
+        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
         .dstAccessMask = vk::AccessFlagBits::eTransferRead,
         .oldLayout = vk::ImageLayout::eGeneral,
         .newLayout = vk::ImageLayout::eGeneral,
@@ -462,65 +684,300 @@ IVideoFrame *Ogler::video_process_frame(std::span<const double> parms,
                 .layerCount = 1,
             },
     };
-    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eBottomOfPipe,
+    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
                                    vk::PipelineStageFlagBits::eTransfer, {}, {},
                                    {}, {img_mem_barrier});
   }
-  {
-    vk::BufferImageCopy region{
-        .imageSubresource =
-            {
-                .aspectMask = vk::ImageAspectFlagBits::eColor,
-                .layerCount = 1,
-            },
-        .imageExtent =
-            {
-                .width = static_cast<uint32_t>(output_image.width),
-                .height = static_cast<uint32_t>(output_image.height),
-                .depth = 1,
-            },
-    };
-    command_buffer.copyImageToBuffer(*output_image.image,
-                                     vk::ImageLayout::eGeneral,
-                                     *output_transfer_buffer.buffer, {region});
+  if (!output.imported) {
+    record_output_download(command_buffer, output_image, output);
   }
-  {
-    vk::BufferMemoryBarrier buf_mem_barrier{
-        .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
-        .dstAccessMask = vk::AccessFlagBits::eHostRead,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .buffer = *output_transfer_buffer.buffer,
-        .size = VK_WHOLE_SIZE,
+  command_buffer.end();
+}
+
+void Ogler::record_stats(vk::raii::CommandBuffer &command_buffer,
+                         size_t descriptor_set,
+                         const std::array<FrameInput, max_num_inputs> &inputs) {
+  auto &program = *stats_compute->program;
+  // Stats descriptor sets are allocated in the same order as the main ones
+  command_buffer.bindDescriptorSets(
+      vk::PipelineBindPoint::eCompute, *program.pipeline_layout, 0,
+      {*stats_compute->descriptor_sets[descriptor_set]}, {});
+
+  auto dispatch_channels = [&](vk::raii::Pipeline &pipeline,
+                               uint32_t num_groups) {
+    command_buffer.bindPipeline(vk::PipelineBindPoint::eCompute, *pipeline);
+    for (uint32_t i = 0; i < max_num_inputs; ++i) {
+      if (!inputs[i].image) {
+        continue;
+      }
+      command_buffer.pushConstants<uint32_t>(*program.pipeline_layout,
+                                             vk::ShaderStageFlagBits::eCompute,
+                                             0, {i});
+      command_buffer.dispatch(num_groups, 1, 1);
+    }
+  };
+
+  // The final pass reads what the first one wrote
+  vk::MemoryBarrier mem_barrier{
+      .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+      .dstAccessMask = vk::AccessFlagBits::eShaderRead,
+  };
+
+  dispatch_channels(program.partial_pipeline, stats_num_groups);
+  command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                                 vk::PipelineStageFlagBits::eComputeShader, {},
+                                 {mem_barrier}, {}, {});
+  dispatch_channels(program.final_pipeline, 1);
+}
+
+IVideoFrame *Ogler::video_process_frame(std::span<const double> parms,
+                                        double project_time, double framerate,
+                                        FrameFormat force_format) noexcept {
+  std::unique_lock<std::mutex> lock(video_mutex, std::try_to_lock_t{});
+  if (!lock.owns_lock()) {
+    return nullptr;
+  }
+
+  if (!compute || frames.empty()) {
+    return nullptr;
+  }
+
+  // Before gmem is copied for this frame, so that the shader sees what it
+  // wrote back
+  write_back_gmem();
+
+  if (frames.size() > 1 && framerate > 0 &&
+      framerate != latency_framerate.load()) {
+    // The latency we reported is expressed in samples, so it needs to be
+    // updated when the video framerate changes. Restarting the plugin for it
+    // would be too disruptive while scrubbing between items.
+    latency_framerate = framerate;
+    latency_changed = true;
+    host.request_callback();
+  }
+
+  update_frame_buffers();
+
+  auto frame_index = next_frame;
+  auto &frame = frames[frame_index];
+  if (frame.pending) {
+    [[unlikely]] retire_frame(frame)->Release();
+  }
+
+  frame.output_frame = vproc->newVideoFrame(
+      output_image.width, output_image.height, (int)FrameFormat::RGBA);
+  auto num_inputs = vproc->getNumInputs();
+
+  FrameBufferRegion output_region;
+  if (auto imported = import_frame(frame, frame.output_frame)) {
+    output_region = *imported;
+    frame.output_imported = true;
+  } else {
+    auto stride = transfer_stride(frame.output_frame);
+    auto transfer_size = stride * output_image.height;
+    // Only ever grown, so that switching back and forth between output
+    // sizes doesn't allocate
+    if (!frame.output_transfer_buffer ||
+        frame.output_transfer_buffer->size < transfer_size) {
+      frame.invalidate();
+      frame.output_transfer_buffer =
+          shared.vulkan.create_readback_buffer<char>(
+              transfer_size, vk::BufferUsageFlagBits::eTransferDst);
+    }
+    output_region = {
+        .buffer = *frame.output_transfer_buffer->buffer,
+        .row_length = static_cast<uint32_t>(stride / 4),
     };
-    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
-                                   vk::PipelineStageFlagBits::eHost, {}, {},
-                                   {buf_mem_barrier}, {});
   }
-  command_buffer.end();
 
-  vk::SubmitInfo SubmitInfo{
-      .commandBufferCount = 1,
-      .pCommandBuffers = &*command_buffer,
+  frame.uniforms_buffer.map[0] = {
+      .iResolution_w = static_cast<float>(output_image.width),
+      .iResolution_h = static_cast<float>(output_image.height),
+      .iTime = static_cast<float>(project_time),
+      .iSampleRate = 0,
+      .iFrameRate = static_cast<float>(framerate),
+      .iWet = static_cast<float>(parms[0]),
+      .num_inputs = std::min({static_cast<int>(max_num_inputs), num_inputs}),
   };
-  queue.submit({SubmitInfo}, *fence);
-  auto res = shared.vulkan.device.waitForFences({*fence},      // List of fences
-                                                true,          // Wait All
-                                                uint64_t(-1)); // Timeout
-  assert(res == vk::Result::eSuccess);
 
-  {
-    auto output_bits = get_frame_bits(output_frame);
-    copy_image(output_transfer_buffer.map, output_bits, output_w, output_h,
-               output_w * 4, output_rowspan);
+  if (frame.params_buffer && !data.parameters.empty()) {
+    // keeping in mind parms[0] is iWet
+    for (size_t i = 0; i < parms.size() - 1; ++i) {
+      frame.params_buffer->map[i] = parms[i + 1];
+    }
+  }
+
+  if (!frame.gmem_output_buffer ||
+      frame.gmem_output_range != shader_gmem_output_range) {
+    frame.invalidate();
+    frame.gmem_output_range = shader_gmem_output_range;
+    frame.gmem_output_buffer = shared.vulkan.create_readback_buffer<float>(
+        std::max(shader_gmem_output_range.second, 1u),
+        vk::BufferUsageFlagBits::eStorageBuffer |
+            vk::BufferUsageFlagBits::eTransferDst);
+  }
+
+  if (stats_compute && !frame.stats_buffer) {
+    frame.stats_buffer = shared.vulkan.create_buffer<ChannelStats>(
+        {}, max_num_inputs, vk::BufferUsageFlagBits::eStorageBuffer,
+        vk::SharingMode::eExclusive, vk::MemoryPropertyFlagBits::eDeviceLocal,
+        false);
+    frame.stats_partials_buffer = shared.vulkan.create_buffer<ChannelStats>(
+        {}, max_num_inputs * stats_num_groups,
+        vk::BufferUsageFlagBits::eStorageBuffer, vk::SharingMode::eExclusive,
+        vk::MemoryPropertyFlagBits::eDeviceLocal, false);
+  }
+
+  auto [gmem_begin, gmem_count] = shader_gmem_range;
+  if (shader_uses_gmem &&
+      !shared.is_gmem_current(project_time, framerate, gmem_begin,
+                              gmem_count)) {
+    {
+      std::unique_lock<EELMutex> eel_lock(*eel_mutex);
+      auto lock_start = std::chrono::steady_clock::now();
+      double **pblocks = *gmem;
+      if (pblocks) {
+        shared.snapshot_gmem(pblocks, gmem_begin, gmem_count, project_time,
+                             framerate);
+      }
+      shared.gmem_lock_stats.record(std::chrono::steady_clock::now() -
+                                    lock_start);
+    }
+    shared.flush_gmem();
+  }
+  auto gmem_bindings = shared.gmem_bindings();
+
+  RecordedFrameKey key{
+      .pipeline = *compute->program->pipeline,
+      .output_image = *output_image.image,
+      .previous_image = *previous_image.image,
+      .output_width = output_image.width,
+      .output_height = output_image.height,
+      .output_row_length = output_region.row_length,
+      .gmem_generation = gmem_bindings.generation,
+      .output_imported = output_region.imported,
+  };
+  std::array<FrameInput, max_num_inputs> inputs{};
+  for (size_t i = 0; i < max_num_inputs; ++i) {
+    IVideoFrame *input_frame = nullptr;
+    if (shader_channels[i]) {
+      input_frame = vproc->renderInputVideoFrame(i, (int)FrameFormat::RGBA);
+    }
+    if (!input_frame) {
+      key.input_sizes[i] = {0, 0};
+      frame.input_resolution_buffer.map[i] = {1.f, 1.f};
+    } else {
+      auto input_w = input_frame->get_w();
+      auto input_h = input_frame->get_h();
+      auto input_rowspan = input_frame->get_rowspan();
+      auto input_stride = transfer_stride(input_frame);
+      auto input_bits = get_frame_bits(input_frame);
+
+      auto &slot = frame.input_images[i];
+      if (!slot || slot->image.width != input_w ||
+          slot->image.height != input_h ||
+          slot->transfer_buffer.size < input_stride * input_h) {
+        // Recordings reference the images themselves, not just their size
+        frame.invalidate();
+        if (slot) {
+          shared.release_input_image(std::move(*slot));
+        }
+        slot = shared.acquire_input_image(input_w, input_h,
+                                          input_stride * input_h);
+      }
+      auto &input_image = *slot;
+
+      key.input_sizes[i] = {input_w, input_h};
+      frame.input_resolution_buffer.map[i] = {static_cast<float>(input_w),
+                                              static_cast<float>(input_h)};
+      inputs[i].image = &input_image;
+
+      // Input frames are only guaranteed to be alive until we return, so
+      // they can only be read in place if we wait for the GPU before that
+      std::optional<FrameBufferRegion> imported;
+      if (frames.size() == 1) {
+        imported = import_frame(frame, input_frame);
+      }
+      if (imported) {
+        inputs[i].source = *imported;
+        key.imported_inputs.set(i);
+      } else {
+        inputs[i].source = {
+            .buffer = *input_image.transfer_buffer.buffer,
+            .row_length = static_cast<uint32_t>(input_stride / 4),
+        };
+        parallel_copy_pixels(shared.workers, upload_pixels, input_bits.data(),
+                             input_image.transfer_buffer.map.data(), input_w,
+                             input_h, input_rowspan, input_stride);
+      }
+      key.input_row_lengths[i] = inputs[i].source.row_length;
+    }
+  }
+
+  auto recording =
+      std::find_if(frame.recordings.begin(), frame.recordings.end(),
+                   [&](const RecordedFrame &rec) { return rec.key == key; });
+  if (recording == frame.recordings.end()) {
+    auto recording_index = frame.next_recording;
+    frame.next_recording = (recording_index + 1) % frame.recordings.size();
+
+    recording = frame.recordings.begin() + recording_index;
+    auto descriptor_set =
+        frame_index * frame.recordings.size() + recording_index;
+    record_frame(frame, *recording, descriptor_set, gmem_bindings, inputs,
+                 output_region);
+    recording->key = key;
   }
 
-  shared.vulkan.device.resetFences({*fence});
-  command_buffer.reset();
+  std::array<vk::CommandBuffer, 3> command_buffers;
+  size_t num_command_buffers = 0;
+  if (!output_image.initialized || !previous_image.initialized ||
+      key.imported_inputs.any()) {
+    auto &setup = frame.setup_command_buffer;
+    setup.reset();
+    setup.begin(vk::CommandBufferBeginInfo{
+        .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit,
+    });
+    for (auto image : {&output_image, &previous_image}) {
+      if (!image->initialized) {
+        transition_image_layout_download(setup, *image);
+        image->initialized = true;
+      }
+    }
+    for (auto &input : inputs) {
+      if (input.image && input.source.imported) {
+        record_input_upload(setup, input);
+      }
+    }
+    setup.end();
+    command_buffers[num_command_buffers++] = *setup;
+  }
+  command_buffers[num_command_buffers++] = *recording->command_buffer;
+  if (output_region.imported) {
+    auto &readback = frame.readback_command_buffer;
+    readback.reset();
+    readback.begin(vk::CommandBufferBeginInfo{
+        .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit,
+    });
+    record_output_download(readback, output_image, output_region);
+    readback.end();
+    command_buffers[num_command_buffers++] = *readback;
+  }
+  shared.submit(std::span(command_buffers.data(), num_command_buffers),
+                *frame.fence);
+  frame.gmem_buffer = std::move(gmem_bindings.buffer);
+  frame.pending = true;
 
   std::swap(output_image, previous_image);
-  std::swap(output_image_view, previous_image_view);
 
-  return output_frame;
+  // With a single frame in flight this is the frame we just submitted,
+  // otherwise it is the oldest one still pending
+  next_frame = (next_frame + 1) % frames.size();
+  auto &oldest_frame = frames[next_frame];
+  if (!oldest_frame.pending) {
+    // The pipeline is still filling up
+    return nullptr;
+  }
+  return retire_frame(oldest_frame);
 }
-} // namespace ogler
\ No newline at end of file
+} // namespace ogler
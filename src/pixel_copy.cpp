@@ -0,0 +1,329 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#include "pixel_copy.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define OGLER_PIXEL_COPY_X86 1
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+// MSVC lets any function use any intrinsic, clang and GCC need to be told
+#if defined(__clang__) || defined(__GNUC__)
+#define OGLER_TARGET(isa) __attribute__((target(isa)))
+#else
+#define OGLER_TARGET(isa)
+#endif
+
+namespace ogler {
+
+static uint32_t load_pixel(const char *src) {
+  uint32_t pixel;
+  std::memcpy(&pixel, src, sizeof(pixel));
+  return pixel;
+}
+
+static void store_pixel(char *dst, uint32_t pixel) {
+  std::memcpy(dst, &pixel, sizeof(pixel));
+}
+
+static uint32_t transform_pixel(uint32_t pixel, unsigned flags) {
+  if (flags & pixel_copy_swap_red_blue) {
+    pixel = (pixel & 0xFF00FF00u) | ((pixel >> 16) & 0xFFu) |
+            ((pixel & 0xFFu) << 16);
+  }
+  if (flags & pixel_copy_opaque_alpha) {
+    pixel |= 0xFF000000u;
+  }
+  return pixel;
+}
+
+// Copies n pixels without vector instructions, returns how many were copied
+static size_t copy_pixels_scalar(const char *&src, char *&dst, size_t n,
+                                 unsigned flags) {
+  if (flags == pixel_copy_plain) {
+    std::memcpy(dst, src, n * 4);
+    src += n * 4;
+    dst += n * 4;
+    return n;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    store_pixel(dst, transform_pixel(load_pixel(src), flags));
+    src += 4;
+    dst += 4;
+  }
+  return n;
+}
+
+// Number of pixels to copy before ptr is aligned to `alignment` bytes. If the
+// pointer is not even aligned to a pixel, it never will be.
+static size_t pixels_until_aligned(const char *ptr, size_t alignment,
+                                   size_t n) {
+  auto misalignment = reinterpret_cast<uintptr_t>(ptr) % alignment;
+  if (misalignment == 0) {
+    return 0;
+  }
+  if (misalignment % 4 != 0) {
+    return n;
+  }
+  auto count = (alignment - misalignment) / 4;
+  return count < n ? count : n;
+}
+
+#ifndef OGLER_PIXEL_COPY_X86
+static void copy_row_scalar(const char *src, char *dst, size_t n,
+                            unsigned flags) {
+  copy_pixels_scalar(src, dst, n, flags);
+}
+
+static const PixelCopyKernels supported_kernels[] = {
+    {"scalar", copy_row_scalar, copy_row_scalar},
+};
+#else
+
+static __m128i transform_sse2(__m128i v, unsigned flags) {
+  if (flags & pixel_copy_swap_red_blue) {
+    auto ga = _mm_and_si128(v, _mm_set1_epi32(static_cast<int>(0xFF00FF00u)));
+    auto r = _mm_and_si128(_mm_srli_epi32(v, 16), _mm_set1_epi32(0xFF));
+    auto b = _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xFF)), 16);
+    v = _mm_or_si128(ga, _mm_or_si128(r, b));
+  }
+  if (flags & pixel_copy_opaque_alpha) {
+    v = _mm_or_si128(v, _mm_set1_epi32(static_cast<int>(0xFF000000u)));
+  }
+  return v;
+}
+
+static void upload_row_sse2(const char *src, char *dst, size_t n,
+                            unsigned flags) {
+  n -= copy_pixels_scalar(src, dst, pixels_until_aligned(dst, 16, n), flags);
+  for (; n >= 4; n -= 4, src += 16, dst += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    _mm_stream_si128(reinterpret_cast<__m128i *>(dst),
+                     transform_sse2(v, flags));
+  }
+  copy_pixels_scalar(src, dst, n, flags);
+}
+
+// SSE2 has no streaming loads, aligned loads are the best it can do
+static void readback_row_sse2(const char *src, char *dst, size_t n,
+                              unsigned flags) {
+  n -= copy_pixels_scalar(src, dst, pixels_until_aligned(src, 16, n), flags);
+  for (; n >= 4; n -= 4, src += 16, dst += 16) {
+    auto v = _mm_load_si128(reinterpret_cast<const __m128i *>(src));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst),
+                     transform_sse2(v, flags));
+  }
+  copy_pixels_scalar(src, dst, n, flags);
+}
+
+OGLER_TARGET("avx2")
+static __m256i transform_avx2(__m256i v, unsigned flags) {
+  if (flags & pixel_copy_swap_red_blue) {
+    auto ga =
+        _mm256_and_si256(v, _mm256_set1_epi32(static_cast<int>(0xFF00FF00u)));
+    auto r =
+        _mm256_and_si256(_mm256_srli_epi32(v, 16), _mm256_set1_epi32(0xFF));
+    auto b =
+        _mm256_slli_epi32(_mm256_and_si256(v, _mm256_set1_epi32(0xFF)), 16);
+    v = _mm256_or_si256(ga, _mm256_or_si256(r, b));
+  }
+  if (flags & pixel_copy_opaque_alpha) {
+    v = _mm256_or_si256(v, _mm256_set1_epi32(static_cast<int>(0xFF000000u)));
+  }
+  return v;
+}
+
+OGLER_TARGET("avx2")
+static void upload_row_avx2(const char *src, char *dst, size_t n,
+                            unsigned flags) {
+  n -= copy_pixels_scalar(src, dst, pixels_until_aligned(dst, 32, n), flags);
+  for (; n >= 8; n -= 8, src += 32, dst += 32) {
+    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+    _mm256_stream_si256(reinterpret_cast<__m256i *>(dst),
+                        transform_avx2(v, flags));
+  }
+  copy_pixels_scalar(src, dst, n, flags);
+}
+
+OGLER_TARGET("avx2")
+static void readback_row_avx2(const char *src, char *dst, size_t n,
+                              unsigned flags) {
+  n -= copy_pixels_scalar(src, dst, pixels_until_aligned(src, 32, n), flags);
+  for (; n >= 8; n -= 8, src += 32, dst += 32) {
+    auto v = _mm256_stream_load_si256(reinterpret_cast<const __m256i *>(src));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst),
+                        transform_avx2(v, flags));
+  }
+  copy_pixels_scalar(src, dst, n, flags);
+}
+
+OGLER_TARGET("avx512f")
+static __m512i transform_avx512(__m512i v, unsigned flags) {
+  if (flags & pixel_copy_swap_red_blue) {
+    auto ga =
+        _mm512_and_si512(v, _mm512_set1_epi32(static_cast<int>(0xFF00FF00u)));
+    auto r =
+        _mm512_and_si512(_mm512_srli_epi32(v, 16), _mm512_set1_epi32(0xFF));
+    auto b =
+        _mm512_slli_epi32(_mm512_and_si512(v, _mm512_set1_epi32(0xFF)), 16);
+    v = _mm512_or_si512(ga, _mm512_or_si512(r, b));
+  }
+  if (flags & pixel_copy_opaque_alpha) {
+    v = _mm512_or_si512(v, _mm512_set1_epi32(static_cast<int>(0xFF000000u)));
+  }
+  return v;
+}
+
+OGLER_TARGET("avx512f")
+static void upload_row_avx512(const char *src, char *dst, size_t n,
+                              unsigned flags) {
+  n -= copy_pixels_scalar(src, dst, pixels_until_aligned(dst, 64, n), flags);
+  for (; n >= 16; n -= 16, src += 64, dst += 64) {
+    auto v = _mm512_loadu_si512(src);
+    _mm512_stream_si512(reinterpret_cast<__m512i *>(dst),
+                        transform_avx512(v, flags));
+  }
+  copy_pixels_scalar(src, dst, n, flags);
+}
+
+OGLER_TARGET("avx512f")
+static void readback_row_avx512(const char *src, char *dst, size_t n,
+                                unsigned flags) {
+  n -= copy_pixels_scalar(src, dst, pixels_until_aligned(src, 64, n), flags);
+  for (; n >= 16; n -= 16, src += 64, dst += 64) {
+    auto v = _mm512_stream_load_si512(const_cast<char *>(src));
+    _mm512_storeu_si512(dst, transform_avx512(v, flags));
+  }
+  copy_pixels_scalar(src, dst, n, flags);
+}
+
+static const PixelCopyKernels avx512_kernels{"avx512", upload_row_avx512,
+                                             readback_row_avx512};
+static const PixelCopyKernels avx2_kernels{"avx2", upload_row_avx2,
+                                           readback_row_avx2};
+static const PixelCopyKernels sse2_kernels{"sse2", upload_row_sse2,
+                                           readback_row_sse2};
+
+struct SupportedKernels {
+  const PixelCopyKernels *kernels[3];
+  size_t count;
+};
+
+OGLER_TARGET("xsave")
+static SupportedKernels detect_kernels() {
+  int regs[4];
+  __cpuid(regs, 0);
+  auto max_leaf = regs[0];
+
+  __cpuid(regs, 1);
+  bool osxsave = regs[2] & (1 << 27);
+  bool avx = regs[2] & (1 << 28);
+  if (!osxsave || !avx || max_leaf < 7) {
+    return {{&sse2_kernels}, 1};
+  }
+
+  // The OS needs to save the wider registers on context switches
+  auto xcr0 = _xgetbv(0);
+  bool ymm_state = (xcr0 & 0x6) == 0x6;
+  bool zmm_state = (xcr0 & 0xE6) == 0xE6;
+
+  __cpuidex(regs, 7, 0);
+  bool avx2 = regs[1] & (1 << 5);
+  bool avx512f = regs[1] & (1 << 16);
+
+  SupportedKernels supported{};
+  if (avx512f && zmm_state) {
+    supported.kernels[supported.count++] = &avx512_kernels;
+  }
+  if (avx2 && ymm_state) {
+    supported.kernels[supported.count++] = &avx2_kernels;
+  }
+  supported.kernels[supported.count++] = &sse2_kernels;
+  return supported;
+}
+
+#endif
+
+std::vector<PixelCopyKernels> supported_pixel_copy_kernels() {
+#ifdef OGLER_PIXEL_COPY_X86
+  auto supported = detect_kernels();
+  std::vector<PixelCopyKernels> res;
+  for (size_t i = 0; i < supported.count; ++i) {
+    res.push_back(*supported.kernels[i]);
+  }
+  return res;
+#else
+  return {std::begin(supported_kernels), std::end(supported_kernels)};
+#endif
+}
+
+static const PixelCopyKernels &kernels() {
+  static const PixelCopyKernels selected =
+      supported_pixel_copy_kernels().front();
+  return selected;
+}
+
+static void copy_rows(PixelRowCopy row_copy, const char *src, char *dst,
+                      size_t w, size_t h, size_t src_stride,
+                      size_t dst_stride, unsigned flags) {
+  if (h == 0) {
+    return;
+  }
+  if (src_stride == dst_stride && src_stride % 4 == 0) {
+    // Padding is copied along, but this is a single contiguous copy
+    row_copy(src, dst, (src_stride * (h - 1)) / 4 + w, flags);
+    return;
+  }
+  for (size_t i = 0; i < h; ++i) {
+    row_copy(src, dst, w, flags);
+    src += src_stride;
+    dst += dst_stride;
+  }
+}
+
+void upload_pixels(const char *src, char *dst, size_t w, size_t h,
+                   size_t src_stride, size_t dst_stride, unsigned flags) {
+  copy_rows(kernels().upload_row, src, dst, w, h, src_stride, dst_stride,
+            flags);
+#ifdef OGLER_PIXEL_COPY_X86
+  // Non-temporal stores are weakly ordered, they need to be visible before the
+  // copy is submitted to the device
+  _mm_sfence();
+#endif
+}
+
+void readback_pixels(const char *src, char *dst, size_t w, size_t h,
+                     size_t src_stride, size_t dst_stride, unsigned flags) {
+  copy_rows(kernels().readback_row, src, dst, w, h, src_stride, dst_stride,
+            flags);
+}
+} // namespace ogler
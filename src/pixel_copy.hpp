@@ -0,0 +1,70 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace ogler {
+
+// Operations that can be applied to each 4-byte pixel during a copy
+enum PixelCopyFlags : unsigned {
+  pixel_copy_plain = 0,
+  // Swaps bytes 0 and 2 of each pixel, converting between BGRA and RGBA
+  pixel_copy_swap_red_blue = 1 << 0,
+  // Forces byte 3 of each pixel to 0xFF
+  pixel_copy_opaque_alpha = 1 << 1,
+};
+
+// Copies n contiguous 4-byte pixels, applying the PixelCopyFlags in flags
+using PixelRowCopy = void (*)(const char *src, char *dst, size_t n,
+                              unsigned flags);
+
+struct PixelCopyKernels {
+  const char *name;
+  PixelRowCopy upload_row;
+  PixelRowCopy readback_row;
+};
+
+// The kernels this CPU can run, the ones used by upload_pixels() and
+// readback_pixels() first
+std::vector<PixelCopyKernels> supported_pixel_copy_kernels();
+
+// Copies h rows of w pixels into mapped device memory. The destination is
+// written with non-temporal stores, as it is usually write-combined and never
+// read back by the CPU.
+void upload_pixels(const char *src, char *dst, size_t w, size_t h,
+                   size_t src_stride, size_t dst_stride,
+                   unsigned flags = pixel_copy_plain);
+
+// Copies h rows of w pixels out of mapped device memory, using streaming loads
+// where available in case the source is uncached. On cached memory they behave
+// like regular loads.
+void readback_pixels(const char *src, char *dst, size_t w, size_t h,
+                     size_t src_stride, size_t dst_stride,
+                   unsigned flags = pixel_copy_plain);
+} // namespace ogler
@@ -0,0 +1,372 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#include "shader_cache.hpp"
+#include "ogler_debug.hpp"
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+#include <bcrypt.h>
+#include <glslang/build_info.h>
+#include <sqlite3.h>
+
+#include <chrono>
+#include <cstring>
+#include <span>
+
+#define OGLER_CACHE_STRINGIZE_(x) #x
+#define OGLER_CACHE_STRINGIZE(x) OGLER_CACHE_STRINGIZE_(x)
+
+namespace ogler {
+
+// Bumped whenever the serialized layout of ShaderData changes
+static constexpr uint32_t cache_format_version = 2;
+
+// Entries not used for this long are removed when the cache is opened
+static constexpr std::chrono::hours cache_max_age{24 * 90};
+
+static int64_t unix_time() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+namespace {
+class Sha256 {
+  BCRYPT_ALG_HANDLE alg{};
+  BCRYPT_HASH_HANDLE hash{};
+
+public:
+  Sha256() {
+    BCryptOpenAlgorithmProvider(&alg, BCRYPT_SHA256_ALGORITHM, nullptr, 0);
+    BCryptCreateHash(alg, &hash, nullptr, 0, nullptr, 0, 0);
+  }
+  ~Sha256() {
+    BCryptDestroyHash(hash);
+    BCryptCloseAlgorithmProvider(alg, 0);
+  }
+
+  void update(const void *data, size_t size) {
+    BCryptHashData(hash, static_cast<PUCHAR>(const_cast<void *>(data)),
+                   static_cast<ULONG>(size), 0);
+  }
+  void update(uint64_t value) { update(&value, sizeof(value)); }
+  // Length-prefixed, so that different splits of the same text differ
+  void update(std::string_view str) {
+    update(static_cast<uint64_t>(str.size()));
+    update(str.data(), str.size());
+  }
+
+  ShaderCache::Key finish() {
+    ShaderCache::Key key{};
+    BCryptFinishHash(hash, key.data(), static_cast<ULONG>(key.size()), 0);
+    return key;
+  }
+};
+
+class Writer {
+  std::vector<unsigned char> &out;
+
+public:
+  explicit Writer(std::vector<unsigned char> &out) : out(out) {}
+
+  void bytes(const void *data, size_t size) {
+    auto begin = static_cast<const unsigned char *>(data);
+    out.insert(out.end(), begin, begin + size);
+  }
+  template <typename T> void value(const T &value) {
+    bytes(&value, sizeof(value));
+  }
+  void string(const std::string &str) {
+    value(static_cast<uint32_t>(str.size()));
+    bytes(str.data(), str.size());
+  }
+  template <typename T> void optional(const std::optional<T> &opt) {
+    value<uint8_t>(opt.has_value());
+    if (opt) {
+      value(*opt);
+    }
+  }
+};
+
+class Reader {
+  std::span<const unsigned char> in;
+
+public:
+  bool ok{true};
+
+  explicit Reader(std::span<const unsigned char> in) : in(in) {}
+
+  bool bytes(void *data, size_t size) {
+    if (!ok || in.size() < size) {
+      ok = false;
+      return false;
+    }
+    if (size > 0) {
+      std::memcpy(data, in.data(), size);
+      in = in.subspan(size);
+    }
+    return true;
+  }
+  template <typename T> T value() {
+    T value{};
+    bytes(&value, sizeof(value));
+    return value;
+  }
+  std::string string() {
+    auto size = value<uint32_t>();
+    if (!ok || in.size() < size) {
+      ok = false;
+      return {};
+    }
+    std::string str(reinterpret_cast<const char *>(in.data()), size);
+    in = in.subspan(size);
+    return str;
+  }
+  template <typename T> std::optional<T> optional() {
+    if (!value<uint8_t>()) {
+      return std::nullopt;
+    }
+    return value<T>();
+  }
+  size_t remaining() const { return in.size(); }
+  bool at_end() const { return ok && in.empty(); }
+};
+} // namespace
+
+static std::vector<unsigned char> serialize(const ShaderData &data) {
+  std::vector<unsigned char> out;
+  Writer w(out);
+  w.value(static_cast<uint32_t>(data.spirv_code.size()));
+  w.bytes(data.spirv_code.data(), data.spirv_code.size() * sizeof(unsigned));
+  w.value(static_cast<uint32_t>(data.parameters.size()));
+  for (auto &param : data.parameters) {
+    w.string(param.name);
+    w.string(param.display_name);
+    w.value(param.default_value);
+    w.value(param.minimum_val);
+    w.value(param.maximum_val);
+    w.value(param.middle_value);
+    w.value(param.step_size);
+  }
+  w.optional(data.output_width);
+  w.optional(data.output_height);
+  w.value<uint8_t>(data.uses_gmem);
+  w.value<uint8_t>(data.uses_stats);
+  w.value<uint8_t>(data.used_channels.has_value());
+  if (data.used_channels) {
+    w.value(static_cast<uint32_t>(data.used_channels->size()));
+    w.bytes(data.used_channels->data(),
+            data.used_channels->size() * sizeof(uint32_t));
+  }
+  w.optional(data.gmem_range);
+  w.optional(data.gmem_output_range);
+  return out;
+}
+
+static std::optional<ShaderData>
+deserialize(std::span<const unsigned char> in) {
+  ShaderData data;
+  Reader r(in);
+  auto code_size = r.value<uint32_t>();
+  if (code_size > r.remaining() / sizeof(unsigned)) {
+    return std::nullopt;
+  }
+  data.spirv_code.resize(code_size);
+  r.bytes(data.spirv_code.data(), data.spirv_code.size() * sizeof(unsigned));
+  auto num_params = r.value<uint32_t>();
+  for (uint32_t i = 0; r.ok && i < num_params; ++i) {
+    auto &param = data.parameters.emplace_back();
+    param.name = r.string();
+    param.display_name = r.string();
+    param.default_value = r.value<float>();
+    param.minimum_val = r.value<float>();
+    param.maximum_val = r.value<float>();
+    param.middle_value = r.value<float>();
+    param.step_size = r.value<float>();
+  }
+  data.output_width = r.optional<int>();
+  data.output_height = r.optional<int>();
+  data.uses_gmem = r.value<uint8_t>();
+  data.uses_stats = r.value<uint8_t>();
+  if (r.value<uint8_t>()) {
+    auto num_channels = r.value<uint32_t>();
+    if (num_channels > r.remaining() / sizeof(uint32_t)) {
+      return std::nullopt;
+    }
+    auto &channels = data.used_channels.emplace(num_channels);
+    r.bytes(channels.data(), channels.size() * sizeof(uint32_t));
+  }
+  data.gmem_range = r.optional<std::pair<uint32_t, uint32_t>>();
+  data.gmem_output_range = r.optional<std::pair<uint32_t, uint32_t>>();
+  if (!r.at_end()) {
+    return std::nullopt;
+  }
+  return data;
+}
+
+ShaderCache::ShaderCache(const std::filesystem::path &path) {
+  if (sqlite3_open16(path.c_str(), &db) != SQLITE_OK) {
+    DBG << "ogler: could not open the shader cache: " << sqlite3_errmsg(db)
+        << "\n";
+    sqlite3_close_v2(db);
+    db = nullptr;
+    return;
+  }
+  // Reads go straight to the mapped file. Other REAPER instances may be
+  // using the cache at the same time, which WAL mode allows.
+  sqlite3_busy_timeout(db, 1000);
+  sqlite3_exec(db,
+               "PRAGMA journal_mode = WAL;"
+               "PRAGMA synchronous = NORMAL;"
+               "PRAGMA mmap_size = 268435456;"
+               "CREATE TABLE IF NOT EXISTS shaders ("
+               "  key BLOB PRIMARY KEY,"
+               "  data BLOB NOT NULL,"
+               "  last_used INTEGER NOT NULL"
+               ") WITHOUT ROWID;",
+               nullptr, nullptr, nullptr);
+
+  sqlite3_stmt *evict_stmt{};
+  sqlite3_prepare_v2(db, "DELETE FROM shaders WHERE last_used < ?", -1,
+                     &evict_stmt, nullptr);
+  sqlite3_bind_int64(
+      evict_stmt, 1,
+      unix_time() -
+          std::chrono::duration_cast<std::chrono::seconds>(cache_max_age)
+              .count());
+  sqlite3_step(evict_stmt);
+  sqlite3_finalize(evict_stmt);
+
+  sqlite3_prepare_v2(db, "SELECT data FROM shaders WHERE key = ?", -1,
+                     &select_stmt, nullptr);
+  sqlite3_prepare_v2(db,
+                     "INSERT OR REPLACE INTO shaders (key, data, last_used) "
+                     "VALUES (?, ?, ?)",
+                     -1, &insert_stmt, nullptr);
+  sqlite3_prepare_v2(db, "UPDATE shaders SET last_used = ? WHERE key = ?", -1,
+                     &touch_stmt, nullptr);
+}
+
+ShaderCache::~ShaderCache() {
+  sqlite3_finalize(select_stmt);
+  sqlite3_finalize(insert_stmt);
+  sqlite3_finalize(touch_stmt);
+  sqlite3_close_v2(db);
+}
+
+ShaderCache::Key ShaderCache::key(
+    const std::vector<std::pair<std::string, std::string>> &source,
+    int params_binding) {
+  Sha256 hash;
+  hash.update(cache_format_version);
+  hash.update(OGLER_VER_MAJOR);
+  hash.update(OGLER_VER_MINOR);
+  hash.update(OGLER_VER_REV);
+  hash.update(OGLER_CACHE_STRINGIZE(OGLER_VULKAN_VER));
+  hash.update(GLSLANG_VERSION_MAJOR);
+  hash.update(GLSLANG_VERSION_MINOR);
+  hash.update(GLSLANG_VERSION_PATCH);
+  hash.update(GLSLANG_VERSION_FLAVOR);
+  hash.update(static_cast<uint64_t>(params_binding));
+  hash.update(static_cast<uint64_t>(source.size()));
+  for (auto &[name, text] : source) {
+    hash.update(name);
+    hash.update(text);
+  }
+  return hash.finish();
+}
+
+std::optional<ShaderData> ShaderCache::load(const Key &key) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!select_stmt) {
+    return std::nullopt;
+  }
+
+  sqlite3_reset(select_stmt);
+  sqlite3_bind_blob(select_stmt, 1, key.data(), static_cast<int>(key.size()),
+                    SQLITE_STATIC);
+  if (sqlite3_step(select_stmt) != SQLITE_ROW) {
+    return std::nullopt;
+  }
+  auto blob =
+      static_cast<const unsigned char *>(sqlite3_column_blob(select_stmt, 0));
+  auto blob_sz = sqlite3_column_bytes(select_stmt, 0);
+  auto data = deserialize({blob, static_cast<size_t>(blob_sz)});
+  sqlite3_reset(select_stmt);
+
+  if (data) {
+    sqlite3_reset(touch_stmt);
+    sqlite3_bind_int64(touch_stmt, 1, unix_time());
+    sqlite3_bind_blob(touch_stmt, 2, key.data(), static_cast<int>(key.size()),
+                      SQLITE_STATIC);
+    sqlite3_step(touch_stmt);
+  }
+  return data;
+}
+
+void ShaderCache::store(const Key &key, const ShaderData &data) {
+  auto blob = serialize(data);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!insert_stmt) {
+    return;
+  }
+
+  sqlite3_reset(insert_stmt);
+  sqlite3_bind_blob(insert_stmt, 1, key.data(), static_cast<int>(key.size()),
+                    SQLITE_STATIC);
+  sqlite3_bind_blob(insert_stmt, 2, blob.data(),
+                    static_cast<int>(blob.size()), SQLITE_STATIC);
+  sqlite3_bind_int64(insert_stmt, 3, unix_time());
+  if (sqlite3_step(insert_stmt) != SQLITE_DONE) {
+    DBG << "ogler: could not store a shader in the cache: "
+        << sqlite3_errmsg(db) << "\n";
+  }
+  sqlite3_reset(insert_stmt);
+}
+
+std::variant<ShaderData, std::string> compile_shader_cached(
+    ShaderCache *cache,
+    const std::vector<std::pair<std::string, std::string>> &source,
+    int params_binding) {
+  if (!cache) {
+    return compile_shader(source, params_binding);
+  }
+
+  auto key = ShaderCache::key(source, params_binding);
+  if (auto data = cache->load(key)) {
+    return std::move(*data);
+  }
+  auto res = compile_shader(source, params_binding);
+  if (auto data = std::get_if<ShaderData>(&res)) {
+    cache->store(key, *data);
+  }
+  return res;
+}
+} // namespace ogler
@@ -0,0 +1,80 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#pragma once
+
+#include "compile_shader.hpp"
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+namespace ogler {
+
+// Results of compile_shader, kept across sessions in a SQLite database. Entries
+// are keyed by a SHA-256 of everything that affects compilation, so they never
+// need to be invalidated, only evicted when unused for long enough.
+class ShaderCache {
+  std::mutex mutex;
+  sqlite3 *db{};
+  sqlite3_stmt *select_stmt{};
+  sqlite3_stmt *insert_stmt{};
+  sqlite3_stmt *touch_stmt{};
+
+public:
+  using Key = std::array<unsigned char, 32>;
+
+  // Opens or creates the database at path. Failures leave the cache disabled,
+  // in which case every lookup misses.
+  explicit ShaderCache(const std::filesystem::path &path);
+  ~ShaderCache();
+
+  ShaderCache(const ShaderCache &) = delete;
+  ShaderCache &operator=(const ShaderCache &) = delete;
+
+  static Key key(const std::vector<std::pair<std::string, std::string>> &source,
+                 int params_binding);
+
+  std::optional<ShaderData> load(const Key &key);
+  void store(const Key &key, const ShaderData &data);
+};
+
+// compile_shader, going through the cache if there is one. Errors are not
+// cached, as they are usually fixed right away.
+std::variant<ShaderData, std::string> compile_shader_cached(
+    ShaderCache *cache,
+    const std::vector<std::pair<std::string, std::string>> &source,
+    int params_binding);
+} // namespace ogler
@@ -26,6 +26,11 @@
 
 #include "vulkan_context.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <string_view>
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
@@ -74,17 +79,38 @@ static uint32_t find_queue_family_index(vk::raii::PhysicalDevice &phys_device) {
                                     }));
 }
 
+static bool has_device_extension(vk::raii::PhysicalDevice &phys_device,
+                                 std::string_view name) {
+  auto extensions = phys_device.enumerateDeviceExtensionProperties();
+  return std::any_of(extensions.begin(), extensions.end(),
+                     [name](const vk::ExtensionProperties &ext) {
+                       return name == ext.extensionName.data();
+                     });
+}
+
 static vk::raii::Device init_device(vk::raii::PhysicalDevice &phys_device,
-                                    uint32_t queue_family_index) {
+                                    uint32_t queue_family_index,
+                                    bool external_memory_host,
+                                    bool dynamic_sampler_indexing) {
   float queue_priority = 0.0f;
   vk::DeviceQueueCreateInfo device_queue_create_info{
       .queueFamilyIndex = queue_family_index,
       .queueCount = 1,
       .pQueuePriorities = &queue_priority,
   };
+  std::vector<const char *> extensions;
+  if (external_memory_host) {
+    extensions.push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+  }
+  vk::PhysicalDeviceFeatures features{
+      .shaderSampledImageArrayDynamicIndexing = dynamic_sampler_indexing,
+  };
   vk::DeviceCreateInfo device_create_info{
       .queueCreateInfoCount = 1,
       .pQueueCreateInfos = &device_queue_create_info,
+      .enabledExtensionCount = static_cast<uint32_t>(extensions.size()),
+      .ppEnabledExtensionNames = extensions.data(),
+      .pEnabledFeatures = &features,
   };
 
   return vk::raii::Device(phys_device, device_create_info);
@@ -116,7 +142,14 @@ VulkanContext::VulkanContext()
     : ctx(), instance(make_instance(ctx)),
       phys_device(std::move(vk::raii::PhysicalDevices(instance).front())),
       queue_family_index(find_queue_family_index(phys_device)),
-      device(init_device(phys_device, queue_family_index)),
+      has_external_memory_host(has_device_extension(
+          phys_device, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME)),
+      has_dynamic_sampler_indexing(
+          phys_device.getFeatures().shaderSampledImageArrayDynamicIndexing),
+      device(init_device(phys_device, queue_family_index,
+                         has_external_memory_host,
+                         has_dynamic_sampler_indexing)),
+      allocator(phys_device, device),
       command_pool(create_command_pool(device, queue_family_index))
 #ifndef NDEBUG
       ,
@@ -130,6 +163,88 @@ VulkanContext::VulkanContext()
       }))
 #endif
 {
+  if (has_external_memory_host) {
+    auto props = phys_device.getProperties2<
+        vk::PhysicalDeviceProperties2,
+        vk::PhysicalDeviceExternalMemoryHostPropertiesEXT>();
+    host_pointer_alignment =
+        props.get<vk::PhysicalDeviceExternalMemoryHostPropertiesEXT>()
+            .minImportedHostPointerAlignment;
+  }
+}
+
+std::optional<HostBuffer>
+VulkanContext::import_host_memory(void *ptr, vk::DeviceSize size,
+                                  vk::BufferUsageFlags usage) {
+  if (!has_external_memory_host || !ptr || size == 0) {
+    return std::nullopt;
+  }
+
+  constexpr auto handle_type =
+      vk::ExternalMemoryHandleTypeFlagBits::eHostAllocationEXT;
+
+  // Both the pointer and the size need to be aligned, so import the whole
+  // range of pages that contains the memory
+  auto address = reinterpret_cast<uintptr_t>(ptr);
+  auto begin = address & ~(host_pointer_alignment - 1);
+  auto end = (address + size + host_pointer_alignment - 1) &
+             ~(host_pointer_alignment - 1);
+  auto aligned_ptr = reinterpret_cast<void *>(begin);
+  auto aligned_size = end - begin;
+
+  try {
+    auto ptr_props = device.getMemoryHostPointerPropertiesEXT(handle_type,
+                                                              aligned_ptr);
+
+    vk::ExternalMemoryBufferCreateInfo external_info{
+        .handleTypes = handle_type,
+    };
+    vk::BufferCreateInfo buffer_info{
+        .pNext = &external_info,
+        .size = aligned_size,
+        .usage = usage,
+        .sharingMode = vk::SharingMode::eExclusive,
+    };
+    auto buf = device.createBuffer(buffer_info);
+    auto reqs = buf.getMemoryRequirements();
+
+    // Without coherent memory the host would need to invalidate ranges it
+    // does not own the mapping of, so only accept coherent types
+    auto props = phys_device.getMemoryProperties();
+    auto type_bits = reqs.memoryTypeBits & ptr_props.memoryTypeBits;
+    std::optional<uint32_t> type_index;
+    for (uint32_t i = 0; i < props.memoryTypeCount; ++i) {
+      if ((type_bits & (1u << i)) &&
+          (props.memoryTypes[i].propertyFlags &
+           vk::MemoryPropertyFlagBits::eHostCoherent)) {
+        type_index = i;
+        break;
+      }
+    }
+    if (!type_index) {
+      return std::nullopt;
+    }
+
+    vk::ImportMemoryHostPointerInfoEXT import_info{
+        .handleType = handle_type,
+        .pHostPointer = aligned_ptr,
+    };
+    vk::MemoryAllocateInfo alloc_info{
+        .pNext = &import_info,
+        .allocationSize = aligned_size,
+        .memoryTypeIndex = *type_index,
+    };
+    auto mem = device.allocateMemory(alloc_info);
+    buf.bindMemory(*mem, 0);
+
+    return HostBuffer{
+        .memory = std::move(mem),
+        .buffer = std::move(buf),
+        .offset = address - begin,
+    };
+  } catch (const vk::SystemError &) {
+    return std::nullopt;
+  }
 }
 
 vk::raii::CommandBuffer VulkanContext::create_command_buffer() {
@@ -161,23 +276,8 @@ Image VulkanContext::create_image(uint32_t width, uint32_t height,
   create_info.usage = usage;
 
   auto image = device.createImage(create_info);
-
-  auto props = phys_device.getMemoryProperties();
-  auto type_index = std::distance(
-      props.memoryTypes.begin(),
-      std::find_if(props.memoryTypes.begin(), props.memoryTypes.end(),
-                   [](const vk::MemoryType &p) {
-                     return p.propertyFlags &
-                            vk::MemoryPropertyFlagBits::eDeviceLocal;
-                   }));
-  auto reqs = image.getMemoryRequirements();
-  vk::MemoryAllocateInfo alloc_info{
-      .allocationSize = reqs.size,
-      .memoryTypeIndex = static_cast<uint32_t>(type_index),
-  };
-
-  auto mem = device.allocateMemory(alloc_info);
-  image.bindMemory(*mem, 0);
+  auto mem =
+      allocator.allocate(image, vk::MemoryPropertyFlagBits::eDeviceLocal);
   return Image(std::move(image), std::move(mem), format, width, height);
 }
 
@@ -207,25 +307,78 @@ VulkanContext::create_shader_module(std::span<const unsigned> code) {
 vk::raii::PipelineLayout VulkanContext::create_pipeline_layout(
     vk::raii::DescriptorSetLayout &descriptor_set_layout,
     int push_constants_size) {
-  std::vector<vk::PushConstantRange> push_constant_range = {
-      vk::PushConstantRange{
-          .stageFlags = vk::ShaderStageFlagBits::eCompute,
-          .offset = 0,
-          .size = static_cast<uint32_t>(push_constants_size),
-      },
-  };
+  std::vector<vk::PushConstantRange> push_constant_range;
+  if (push_constants_size > 0) {
+    push_constant_range.push_back(vk::PushConstantRange{
+        .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        .offset = 0,
+        .size = static_cast<uint32_t>(push_constants_size),
+    });
+  }
   std::vector<vk::DescriptorSetLayout> set_layout = {*descriptor_set_layout};
   vk::PipelineLayoutCreateInfo create_info{
       .setLayoutCount = 1,
       .pSetLayouts = set_layout.data(),
-      .pushConstantRangeCount = 1,
+      .pushConstantRangeCount =
+          static_cast<uint32_t>(push_constant_range.size()),
       .pPushConstantRanges = push_constant_range.data(),
   };
   return device.createPipelineLayout(create_info);
 }
 
-vk::raii::PipelineCache VulkanContext::create_pipeline_cache() {
-  return device.createPipelineCache(vk::PipelineCacheCreateInfo());
+namespace {
+struct PipelineCachePrefix {
+  std::array<char, 4> magic;
+  uint32_t driver_version;
+  uint64_t data_size;
+};
+} // namespace
+
+static constexpr std::array<char, 4> pipeline_cache_magic = {'O', 'G', 'P',
+                                                             'C'};
+
+vk::raii::PipelineCache
+VulkanContext::create_pipeline_cache(std::span<const char> initial_data) {
+  // Drivers are supposed to reject data they didn't produce, but not all of
+  // them do it gracefully
+  auto props = phys_device.getProperties();
+  PipelineCachePrefix prefix{};
+  vk::PipelineCacheHeaderVersionOne header{};
+  bool valid = initial_data.size() >= sizeof(prefix) + sizeof(header);
+  if (valid) {
+    std::memcpy(&prefix, initial_data.data(), sizeof(prefix));
+    initial_data = initial_data.subspan(sizeof(prefix));
+    std::memcpy(&header, initial_data.data(), sizeof(header));
+    valid = prefix.magic == pipeline_cache_magic &&
+            prefix.driver_version == props.driverVersion &&
+            prefix.data_size == initial_data.size() &&
+            header.headerSize >= sizeof(header) &&
+            header.headerVersion == vk::PipelineCacheHeaderVersion::eOne &&
+            header.vendorID == props.vendorID &&
+            header.deviceID == props.deviceID &&
+            header.pipelineCacheUUID == props.pipelineCacheUUID;
+  }
+
+  vk::PipelineCacheCreateInfo create_info{};
+  if (valid) {
+    create_info.initialDataSize = initial_data.size();
+    create_info.pInitialData = initial_data.data();
+  }
+  return device.createPipelineCache(create_info);
+}
+
+std::vector<char>
+VulkanContext::get_pipeline_cache_data(vk::raii::PipelineCache &cache) {
+  auto data = cache.getData();
+  PipelineCachePrefix prefix{
+      .magic = pipeline_cache_magic,
+      .driver_version = phys_device.getProperties().driverVersion,
+      .data_size = data.size(),
+  };
+  std::vector<char> res(sizeof(prefix) + data.size());
+  std::memcpy(res.data(), &prefix, sizeof(prefix));
+  std::memcpy(res.data() + sizeof(prefix), data.data(), data.size());
+  return res;
 }
 
 vk::raii::Pipeline VulkanContext::create_compute_pipeline(
@@ -26,42 +26,54 @@
 
 #pragma once
 
+#include "memory_allocator.hpp"
+
 #define VULKAN_HPP_NO_STRUCT_CONSTRUCTORS
 #include <vulkan/vulkan_raii.hpp>
 
 #include <optional>
 #include <span>
 #include <utility>
+#include <vector>
 
 namespace ogler {
+// The memory is declared first so that it is released after the resource
+// bound to it is destroyed
 struct Image {
+  Allocation memory;
   vk::raii::Image image;
-  vk::raii::DeviceMemory memory;
   vk::Format format;
 
   int width;
   int height;
 
-  Image(vk::raii::Image &&img, vk::raii::DeviceMemory &&mem, vk::Format fmt,
-        int w, int h)
-      : image(std::move(img)), memory(std::move(mem)), format(fmt), width(w),
+  Image(vk::raii::Image &&img, Allocation &&mem, vk::Format fmt, int w, int h)
+      : memory(std::move(mem)), image(std::move(img)), format(fmt), width(w),
         height(h) {}
 };
 
 template <typename T = char> struct Buffer {
+  Allocation memory;
   vk::raii::Buffer buffer;
-  vk::raii::DeviceMemory memory;
   std::span<T> map;
 
   int size;
 
-  Buffer(vk::raii::Buffer &&buf, vk::raii::DeviceMemory &&mem, int sz,
-         bool do_map)
-      : buffer(std::move(buf)), memory(std::move(mem)), size(sz),
-        map(do_map
-                ? std::span<T>(
-                      static_cast<T *>(memory.mapMemory(0, sz * sizeof(T))), sz)
-                : std::span<T>()) {}
+  Buffer(vk::raii::Buffer &&buf, Allocation &&mem, int sz, bool do_map)
+      : memory(std::move(mem)), buffer(std::move(buf)),
+        map(do_map ? std::span<T>(static_cast<T *>(memory.mapped()), sz)
+                   : std::span<T>()),
+        size(sz) {}
+};
+
+// Memory owned by the host, made available to the device without copying.
+// Members are in the same order as in Buffer, for the same reason.
+struct HostBuffer {
+  vk::raii::DeviceMemory memory;
+  vk::raii::Buffer buffer;
+  // Offset of the imported pointer from the start of the buffer, since the
+  // imported range has to be rounded to the device's alignment
+  vk::DeviceSize offset;
 };
 
 class VulkanContext {
@@ -70,44 +82,55 @@ public:
   vk::raii::Instance instance;
   vk::raii::PhysicalDevice phys_device;
   uint32_t queue_family_index;
+  bool has_external_memory_host;
+  // Whether sampler arrays can be indexed with dynamically uniform values
+  bool has_dynamic_sampler_indexing;
   vk::raii::Device device;
+  MemoryAllocator allocator;
   vk::raii::CommandPool command_pool;
 
   std::optional<vk::raii::DebugUtilsMessengerEXT> debug_messenger;
 
+  vk::DeviceSize host_pointer_alignment{};
+
   VulkanContext();
 
   template <typename T>
   Buffer<T> create_buffer(vk::BufferCreateFlags create_flags,
                           vk::DeviceSize size, vk::BufferUsageFlags usage_flags,
                           vk::SharingMode sharing_mode,
-                          vk::MemoryPropertyFlags properties, bool map = true) {
+                          vk::MemoryPropertyFlags properties, bool map = true,
+                          vk::MemoryPropertyFlags preferred = {}) {
     vk::BufferCreateInfo info{
         .flags = create_flags,
         .size = size * sizeof(T),
         .usage = usage_flags,
         .sharingMode = sharing_mode,
     };
-    auto props = phys_device.getMemoryProperties();
-    auto type_index = std::distance(
-        props.memoryTypes.begin(),
-        std::find_if(props.memoryTypes.begin(), props.memoryTypes.end(),
-                     [properties](const auto &p) {
-                       return (p.propertyFlags & properties) == properties;
-                     }));
     auto buf = device.createBuffer(info);
-    auto reqs = buf.getMemoryRequirements();
-    vk::MemoryAllocateInfo alloc_info{
-        .allocationSize = reqs.size,
-        .memoryTypeIndex = static_cast<uint32_t>(type_index),
-    };
-
-    auto mem = device.allocateMemory(alloc_info);
-    buf.bindMemory(*mem, 0);
+    auto mem = allocator.allocate(buf, properties, preferred);
 
     return Buffer<T>(std::move(buf), std::move(mem), size, map);
   }
 
+  // Buffers the CPU reads from are much faster to access in cached memory,
+  // which may not be coherent: call invalidate() on their memory before
+  // reading. Buffers only written by the CPU should stay in uncached memory,
+  // where writes are combined.
+  template <typename T>
+  Buffer<T> create_readback_buffer(vk::DeviceSize size,
+                                   vk::BufferUsageFlags usage_flags) {
+    return create_buffer<T>({}, size, usage_flags, vk::SharingMode::eExclusive,
+                            vk::MemoryPropertyFlagBits::eHostVisible, true,
+                            vk::MemoryPropertyFlagBits::eHostCached |
+                                vk::MemoryPropertyFlagBits::eHostCoherent);
+  }
+
+  // Returns std::nullopt if the device cannot use the memory directly, in
+  // which case the caller should fall back to a staging buffer
+  std::optional<HostBuffer> import_host_memory(void *ptr, vk::DeviceSize size,
+                                               vk::BufferUsageFlags usage);
+
   vk::raii::CommandBuffer create_command_buffer();
 
   Image create_image(uint32_t width, uint32_t height, vk::Format format,
@@ -121,7 +144,13 @@ public:
   create_pipeline_layout(vk::raii::DescriptorSetLayout &descriptor_set_layout,
                          int push_constants_size);
 
-  vk::raii::PipelineCache create_pipeline_cache();
+  // Seeds the cache with initial_data if it was produced by this same device
+  // and driver, otherwise it starts empty
+  vk::raii::PipelineCache
+  create_pipeline_cache(std::span<const char> initial_data = {});
+  // Pipeline cache data with a header identifying the driver, since the one
+  // Vulkan defines doesn't include its version
+  std::vector<char> get_pipeline_cache_data(vk::raii::PipelineCache &cache);
 
   vk::raii::Pipeline
   create_compute_pipeline(vk::raii::ShaderModule &module,
@@ -0,0 +1,132 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#include "worker_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace ogler {
+
+WorkerPool::WorkerPool(unsigned num_workers) {
+  for (unsigned i = 0; i < num_workers; ++i) {
+    threads.emplace_back([this]() { run(); });
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  jobs_available.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+void WorkerPool::run() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      jobs_available.wait(lock, [this]() {
+        return stopping || !chunk_jobs.empty() || !background_jobs.empty();
+      });
+      auto &queue = chunk_jobs.empty() ? background_jobs : chunk_jobs;
+      if (queue.empty()) {
+        return;
+      }
+      job = std::move(queue.front());
+      queue.pop_front();
+    }
+    job();
+  }
+}
+
+void WorkerPool::enqueue(std::function<void()> job) {
+  if (threads.empty()) {
+    job();
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    background_jobs.push_back(std::move(job));
+  }
+  jobs_available.notify_one();
+}
+
+void WorkerPool::parallel_for(size_t count, size_t min_chunk,
+                              const std::function<void(size_t, size_t)> &fn) {
+  auto num_chunks =
+      std::min(threads.size() + 1, count / std::max<size_t>(min_chunk, 1));
+  if (num_chunks <= 1) {
+    if (count > 0) {
+      fn(0, count);
+    }
+    return;
+  }
+
+  // Chunks are claimed rather than assigned: workers that only get to their
+  // job after the caller has already processed everything find nothing left
+  // and never touch fn, which is only valid until we return. This also means
+  // nested or concurrent calls can't deadlock waiting for busy workers.
+  struct State {
+    std::atomic<size_t> next_chunk{};
+    std::atomic<size_t> finished_chunks{};
+  };
+  auto state = std::make_shared<State>();
+
+  auto process_chunks = [state, num_chunks, count, &fn]() {
+    while (true) {
+      auto chunk = state->next_chunk.fetch_add(1);
+      if (chunk >= num_chunks) {
+        return;
+      }
+      fn(count * chunk / num_chunks, count * (chunk + 1) / num_chunks);
+      if (state->finished_chunks.fetch_add(1) + 1 == num_chunks) {
+        state->finished_chunks.notify_all();
+      }
+    }
+  };
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (size_t i = 0; i < num_chunks - 1; ++i) {
+      chunk_jobs.push_back(process_chunks);
+    }
+  }
+  jobs_available.notify_all();
+
+  process_chunks();
+
+  size_t finished;
+  while ((finished = state->finished_chunks.load()) != num_chunks) {
+    state->finished_chunks.wait(finished);
+  }
+}
+} // namespace ogler
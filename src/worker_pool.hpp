@@ -0,0 +1,72 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ogler {
+
+// A fixed set of threads kept around for the whole lifetime of the plugin, so
+// that splitting work across cores doesn't pay for thread creation each time
+class WorkerPool {
+  std::mutex mutex;
+  std::condition_variable jobs_available;
+  // Chunks of parallel_for() calls, which someone is waiting for, always run
+  // before the background jobs
+  std::deque<std::function<void()>> chunk_jobs;
+  std::deque<std::function<void()>> background_jobs;
+  bool stopping{};
+  std::vector<std::thread> threads;
+
+  void run();
+
+public:
+  explicit WorkerPool(unsigned num_workers);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  size_t num_workers() const { return threads.size(); }
+
+  // Queues a job to be run on one of the workers once no parallel_for() chunks
+  // are waiting. Without workers, the job is run right away on the calling
+  // thread.
+  void enqueue(std::function<void()> job);
+
+  // Splits [0, count) into chunks of at least min_chunk elements and calls
+  // fn(begin, end) for each of them, both on the workers and on the calling
+  // thread. Returns once every chunk has been processed.
+  void parallel_for(size_t count, size_t min_chunk,
+                    const std::function<void(size_t, size_t)> &fn);
+};
+} // namespace ogler
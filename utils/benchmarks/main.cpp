@@ -0,0 +1,264 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+// Checks the pixel copy kernels against a scalar reference, then times them
+// against a plain memcpy, first between regular cached buffers to measure the
+// kernels themselves, then reading frames back out of host cached and uncached
+// device memory.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pixel_copy.hpp"
+#include "vulkan_context.hpp"
+
+using namespace ogler;
+
+static constexpr int num_iterations = 50;
+
+struct Resolution {
+  std::string_view name;
+  size_t width;
+  size_t height;
+};
+
+// Best of num_iterations, in bytes per second
+template <typename Copy>
+static double measure(Copy copy, const char *src, char *dst, size_t bytes) {
+  using clock = std::chrono::steady_clock;
+  // Fault in the pages and warm up the caches
+  copy(src, dst);
+  auto best = clock::duration::max();
+  for (int i = 0; i < num_iterations; ++i) {
+    auto start = clock::now();
+    copy(src, dst);
+    best = std::min(best, clock::now() - start);
+  }
+  return bytes / std::chrono::duration<double>(best).count();
+}
+
+static void report(std::string_view resolution, std::string_view name,
+                   double bandwidth, double baseline) {
+  std::cout << std::left << std::setw(8) << resolution << std::setw(20) << name
+            << std::right << std::fixed << std::setprecision(2)
+            << std::setw(8) << bandwidth / 1e9 << " GB/s" << std::setw(8)
+            << bandwidth / baseline << "x" << std::endl;
+}
+
+static const Resolution resolutions[] = {
+    {"1080p", 1920, 1080},
+    {"4K", 3840, 2160},
+};
+
+static uint32_t reference_pixel(uint32_t pixel, unsigned flags) {
+  uint8_t bytes[4];
+  std::memcpy(bytes, &pixel, sizeof(pixel));
+  if (flags & pixel_copy_swap_red_blue) {
+    std::swap(bytes[0], bytes[2]);
+  }
+  if (flags & pixel_copy_opaque_alpha) {
+    bytes[3] = 0xFF;
+  }
+  std::memcpy(&pixel, bytes, sizeof(pixel));
+  return pixel;
+}
+
+// Every kernel with every combination of flags, starting from each offset
+// within a vector and with lengths that leave a scalar tail
+static bool verify_kernels() {
+  static constexpr size_t max_pixels = 133;
+  static constexpr size_t max_offset = 16;
+  static constexpr unsigned all_flags[] = {
+      pixel_copy_plain,
+      pixel_copy_swap_red_blue,
+      pixel_copy_opaque_alpha,
+      pixel_copy_swap_red_blue | pixel_copy_opaque_alpha,
+  };
+
+  // 64-byte aligned, so that offsets cover every alignment of the vectors
+  std::vector<uint32_t> src_storage(max_pixels + max_offset + 16);
+  std::vector<uint32_t> dst_storage(max_pixels + max_offset + 16);
+  auto align = [](uint32_t *ptr) {
+    auto misalignment = reinterpret_cast<uintptr_t>(ptr) % 64;
+    return reinterpret_cast<char *>(ptr) +
+           (misalignment ? 64 - misalignment : 0);
+  };
+  auto src_base = align(src_storage.data());
+  auto dst_base = align(dst_storage.data());
+  for (size_t i = 0; i < (max_pixels + max_offset) * 4; ++i) {
+    src_base[i] = static_cast<char>(i * 37 + 11);
+  }
+
+  for (auto &kernel : supported_pixel_copy_kernels()) {
+    for (auto [direction, row_copy] :
+         {std::pair{"upload", kernel.upload_row},
+          std::pair{"readback", kernel.readback_row}}) {
+      for (auto flags : all_flags) {
+        for (size_t offset = 0; offset < max_offset; ++offset) {
+          for (size_t n = 0; n <= max_pixels; ++n) {
+            auto src = src_base + offset * 4;
+            auto dst = dst_base + (max_offset - 1 - offset) * 4;
+            std::fill_n(dst, (n + 1) * 4, 0);
+            row_copy(src, dst, n, flags);
+
+            bool ok = true;
+            for (size_t i = 0; i < n; ++i) {
+              uint32_t in, out;
+              std::memcpy(&in, src + i * 4, 4);
+              std::memcpy(&out, dst + i * 4, 4);
+              ok = ok && out == reference_pixel(in, flags);
+            }
+            // Nothing past the end is touched
+            uint32_t past_end;
+            std::memcpy(&past_end, dst + n * 4, 4);
+            if (!ok || past_end != 0) {
+              std::cerr << kernel.name << " " << direction << " with flags "
+                        << flags << " is wrong for " << n
+                        << " pixels at offset " << offset << std::endl;
+              return false;
+            }
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+static bool benchmark_kernels() {
+  auto kernels = supported_pixel_copy_kernels();
+
+  for (auto &resolution : resolutions) {
+    auto pixels = resolution.width * resolution.height;
+    auto bytes = pixels * 4;
+    std::vector<char> src(bytes);
+    std::vector<char> dst(bytes);
+    for (size_t i = 0; i < bytes; ++i) {
+      src[i] = static_cast<char>(i);
+    }
+
+    auto baseline = measure(
+        [&](const char *s, char *d) { std::memcpy(d, s, bytes); }, src.data(),
+        dst.data(), bytes);
+    report(resolution.name, "memcpy", baseline, baseline);
+
+    for (auto &kernel : kernels) {
+      for (auto [direction, row_copy] :
+           {std::pair{"upload", kernel.upload_row},
+            std::pair{"readback", kernel.readback_row}}) {
+        std::fill(dst.begin(), dst.end(), 0);
+        auto bandwidth = measure(
+            [&](const char *s, char *d) {
+              row_copy(s, d, pixels, pixel_copy_plain);
+            },
+            src.data(), dst.data(), bytes);
+        if (dst != src) {
+          std::cerr << kernel.name << " " << direction
+                    << " produced a wrong copy" << std::endl;
+          return false;
+        }
+        report(resolution.name, std::string(kernel.name) + " " + direction,
+               bandwidth, baseline);
+      }
+    }
+  }
+  return true;
+}
+
+// Reads frames back the way retired frames are, from memory the device could
+// have written to. Only the CPU side is measured, the contents do not matter.
+static void benchmark_readback(VulkanContext &vulkan) {
+  using Flags = vk::MemoryPropertyFlagBits;
+  struct Memory {
+    std::string_view name;
+    vk::MemoryPropertyFlags required;
+  };
+  const Memory memories[] = {
+      {"cached", Flags::eHostVisible | Flags::eHostCached},
+      {"uncached", Flags::eHostVisible | Flags::eHostCoherent},
+  };
+
+  for (auto &memory : memories) {
+    // The allocator makes the same choice, as it avoids flags nobody asked for
+    auto type = vulkan.allocator.find_memory_type(~0u, memory.required, {});
+    bool cached = type && bool(vulkan.allocator.memory_type_flags(*type) &
+                               Flags::eHostCached);
+    if (!type || cached != bool(memory.required & Flags::eHostCached)) {
+      std::cout << "No " << memory.name << " host visible memory type"
+                << std::endl;
+      continue;
+    }
+
+    for (auto &resolution : resolutions) {
+      auto bytes = resolution.width * resolution.height * 4;
+      auto buffer = vulkan.create_buffer<char>(
+          {}, bytes, vk::BufferUsageFlagBits::eTransferDst,
+          vk::SharingMode::eExclusive, memory.required);
+      std::fill(buffer.map.begin(), buffer.map.end(), 0);
+      std::vector<char> dst(bytes);
+
+      auto label = std::string(memory.name) + " ";
+      auto baseline = measure(
+          [&](const char *s, char *d) {
+            buffer.memory.invalidate();
+            std::memcpy(d, s, bytes);
+          },
+          buffer.map.data(), dst.data(), bytes);
+      report(resolution.name, label + "memcpy", baseline, baseline);
+
+      auto bandwidth = measure(
+          [&](const char *s, char *d) {
+            buffer.memory.invalidate();
+            readback_pixels(s, d, resolution.width, resolution.height,
+                            resolution.width * 4, resolution.width * 4);
+          },
+          buffer.map.data(), dst.data(), bytes);
+      report(resolution.name, label + "readback", bandwidth, baseline);
+    }
+  }
+}
+
+int main() {
+  if (!verify_kernels() || !benchmark_kernels()) {
+    return EXIT_FAILURE;
+  }
+
+  try {
+    VulkanContext vulkan;
+    benchmark_readback(vulkan);
+  } catch (vk::Error &e) {
+    std::cerr << "Skipping the readback benchmark: " << e.what() << std::endl;
+  }
+  return EXIT_SUCCESS;
+}